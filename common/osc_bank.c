@@ -0,0 +1,109 @@
+/*************************************************************************
+ File Name: osc_bank.c
+ Description: Bank of sine voices mixed into planar float channels
+ ************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "osc_bank.h"
+
+int osc_bank_init(struct osc_bank *bank, unsigned int max_voices, unsigned int channels, unsigned int max_frames)
+{
+    memset(bank, 0, sizeof(*bank));
+    bank->voices = calloc(max_voices, sizeof(struct voice));
+    bank->mix = malloc((unsigned long)channels * max_frames * sizeof(float));
+    bank->scratch = malloc(max_frames * sizeof(float));
+    if (bank->voices == NULL || bank->mix == NULL || bank->scratch == NULL)
+    {
+        osc_bank_free(bank);
+        return -1;
+    }
+    bank->max_voices = max_voices;
+    bank->channels = channels;
+    bank->max_frames = max_frames;
+    return 0;
+}
+
+void osc_bank_free(struct osc_bank *bank)
+{
+    free(bank->voices);
+    free(bank->mix);
+    free(bank->scratch);
+    memset(bank, 0, sizeof(*bank));
+}
+
+int osc_bank_add(struct osc_bank *bank, double freq, unsigned int rate, float gain, unsigned long route)
+{
+    struct voice *v;
+
+    if (bank->nvoices == bank->max_voices)
+        return -1;
+    v = &bank->voices[bank->nvoices];
+    osc_init(&v->osc, freq, rate);
+    v->gain = gain;
+    v->route = route;
+    return bank->nvoices++;
+}
+
+/*
+ * A voice routed to a single channel is rendered straight into that channel,
+ * otherwise it is rendered once and accumulated into every routed channel.
+ * All loops are element-wise over contiguous float arrays.
+ */
+void osc_bank_render(struct osc_bank *bank, unsigned int frames)
+{
+    unsigned long all = bank->channels >= OSC_BANK_MAX_CHANNELS ? ~0UL : (1UL << bank->channels) - 1;
+    unsigned int v, ch, i;
+
+    memset(bank->mix, 0, (unsigned long)bank->channels * bank->max_frames * sizeof(float));
+
+    for (v = 0; v < bank->nvoices; v++)
+    {
+        struct voice *voice = &bank->voices[v];
+        unsigned long route = voice->route & all;
+
+        if (route == 0)
+        {
+            /* keep phase running, so that re-routing later doesn't jump */
+            voice->osc.phase = fmod(voice->osc.phase + frames * voice->osc.step, 2 * M_PI);
+            continue;
+        }
+        if ((route & (route - 1)) == 0)
+        {
+            ch = __builtin_ctzl(route);
+            osc_render_mix(&voice->osc, bank->mix + (unsigned long)ch * bank->max_frames, frames, voice->gain);
+            continue;
+        }
+
+        osc_render(&voice->osc, bank->scratch, frames);
+        for (ch = 0; ch < bank->channels && ch < OSC_BANK_MAX_CHANNELS; ch++)
+        {
+            float *dst = bank->mix + (unsigned long)ch * bank->max_frames;
+            const float *src = bank->scratch;
+            float gain = voice->gain;
+
+            if (!(route & (1UL << ch)))
+                continue;
+            for (i = 0; i < frames; i++)
+            {
+                dst[i] += gain * src[i];
+            }
+        }
+    }
+
+    /* clip, so that packers never see values out of range */
+    for (ch = 0; ch < bank->channels; ch++)
+    {
+        float *dst = bank->mix + (unsigned long)ch * bank->max_frames;
+
+        for (i = 0; i < frames; i++)
+        {
+            float x = dst[i];
+
+            x = x > 1.0f ? 1.0f : x;
+            x = x < -1.0f ? -1.0f : x;
+            dst[i] = x;
+        }
+    }
+}
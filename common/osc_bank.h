@@ -0,0 +1,61 @@
+/*************************************************************************
+ File Name: osc_bank.h
+ Description: Bank of sine voices mixed into planar float channels
+ ************************************************************************/
+
+#ifndef OSC_BANK_H
+#define OSC_BANK_H
+
+#include "oscillator.h"
+
+/* Channels reachable by a voice route, one bit per channel */
+#define OSC_BANK_MAX_CHANNELS   (sizeof(unsigned long) * 8)
+#define OSC_BANK_ROUTE_ALL      (~0UL)
+
+struct voice
+{
+    struct oscillator osc;
+    float gain;
+    unsigned long route;        // bit n set: voice is mixed into channel n
+};
+
+struct osc_bank
+{
+    struct voice *voices;
+    unsigned int nvoices;
+    unsigned int max_voices;
+    unsigned int channels;
+    unsigned int max_frames;    // most frames rendered in one go
+    float *mix;                 // planar mix buffer, `channels` x `max_frames`
+    float *scratch;             // one voice, `max_frames`
+};
+
+/*
+ * @brief               Allocate a bank, all memory is allocated here and nowhere else
+ * @return              0 on success, -1 on no memory
+ */
+int osc_bank_init(struct osc_bank *bank, unsigned int max_voices, unsigned int channels, unsigned int max_frames);
+void osc_bank_free(struct osc_bank *bank);
+
+/*
+ * @brief               Add a voice
+ * @in route            Channels to mix the voice into, see struct voice
+ * @return              Index of the voice, or -1 if bank is full
+ */
+int osc_bank_add(struct osc_bank *bank, double freq, unsigned int rate, float gain, unsigned long route);
+
+/*
+ * @brief               Mix `frames` frames of all voices, result clipped to [-1.0, 1.0]
+ *                      and available from osc_bank_channel()
+ */
+void osc_bank_render(struct osc_bank *bank, unsigned int frames);
+
+/*
+ * @brief               Mixed samples of one channel, valid until next render
+ */
+static inline const float *osc_bank_channel(const struct osc_bank *bank, unsigned int ch)
+{
+    return bank->mix + (unsigned long)ch * bank->max_frames;
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*************************************************************************
+ File Name: osc_bank_bench.c
+ Description: How many oscillator bank voices one core sustains at 48kHz
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "osc_bank.h"
+
+#define BENCH_RATE      48000
+#define BENCH_PERIOD    1024            // frames per rendered period
+#define BENCH_AUDIO_SEC 2               // seconds of audio rendered per voice count
+
+static double cpu_now(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tp);
+    return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned int voice_counts[] = { 1, 16, 64, 256, 512, 1024 };
+    unsigned int channels = 2;
+    unsigned int k, v, n, periods;
+    struct osc_bank bank;
+    double start, cpu;
+
+    if (argc > 1)
+        channels = atoi(argv[1]);
+    if (channels == 0 || channels > OSC_BANK_MAX_CHANNELS)
+    {
+        fprintf(stderr, "Usage: %s [channels]\n", argv[0]);
+        return 1;
+    }
+
+    periods = BENCH_AUDIO_SEC * BENCH_RATE / BENCH_PERIOD;
+    printf("rate %dHz, %u channels, period %d frames\n", BENCH_RATE, channels, BENCH_PERIOD);
+    printf("%8s %14s %14s\n", "voices", "cpu/audio", "voices/core");
+    for (k = 0; k < sizeof(voice_counts) / sizeof(voice_counts[0]); k++)
+    {
+        unsigned int nvoices = voice_counts[k];
+
+        if (osc_bank_init(&bank, nvoices, channels, BENCH_PERIOD) < 0)
+        {
+            fprintf(stderr, "No enough memory\n");
+            return 1;
+        }
+        /* every voice on its own channel, except each 4th one which goes to all */
+        for (v = 0; v < nvoices; v++)
+        {
+            unsigned long route = v % 4 == 3 ? OSC_BANK_ROUTE_ALL : 1UL << (v % channels);
+
+            osc_bank_add(&bank, 100.0 + v * 7.0, BENCH_RATE, 1.0f / nvoices, route);
+        }
+
+        start = cpu_now();
+        for (n = 0; n < periods; n++)
+        {
+            osc_bank_render(&bank, BENCH_PERIOD);
+        }
+        cpu = (cpu_now() - start) / ((double)periods * BENCH_PERIOD / BENCH_RATE);
+        printf("%8u %13.4f%% %14.0f\n", nvoices, cpu * 100, nvoices / cpu);
+
+        osc_bank_free(&bank);
+    }
+    return 0;
+}
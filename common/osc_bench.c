@@ -0,0 +1,127 @@
+/*************************************************************************
+ File Name: osc_bench.c
+ Description: Compare the libm per-frame sine path with the oscillator
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "oscillator.h"
+
+#define BENCH_PERIOD    1024            // frames per generated period
+#define BENCH_SECONDS   1.0             // run time of each path
+
+static unsigned int rate = 48000;
+static unsigned int channels = 2;
+static double freq = 4000;
+
+static double now(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/*
+ * @brief       Per-frame sin() with byte-wise S16_LE packing, i.e. what
+ *              generate_sine_wave() in my_playback.c did before
+ */
+static void legacy_period(unsigned char *buf, unsigned int frames, double *phase)
+{
+    double step = 2 * M_PI * freq / rate;
+    int format_width = 16, bps = 2, phys_bps = 2;
+    unsigned int frame, ch;
+    int i, res;
+
+    for (frame = 0; frame < frames; frame++)
+    {
+        *phase += step;
+        if (*phase > 2*M_PI)
+        {
+            *phase -= 2*M_PI;
+        }
+        res = sin(*phase) * ((1 << (format_width-1))-1);
+        for (ch = 0; ch < channels; ch++)
+        {
+            for (i = 0; i < bps; i++)
+            {
+                *(buf + ch*phys_bps + frame*channels*phys_bps + i) = (res >> i*8) & 0xff;
+            }
+        }
+    }
+}
+
+static void osc_period(short *buf, float *scratch, unsigned int frames, struct oscillator *osc)
+{
+    unsigned int frame, ch;
+
+    osc_render(osc, scratch, frames);
+    for (frame = 0; frame < frames; frame++)
+    {
+        short s = (short)(scratch[frame] * 32767);
+
+        for (ch = 0; ch < channels; ch++)
+        {
+            buf[frame * channels + ch] = s;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char *buf;
+    float *scratch;
+    struct oscillator osc;
+    double phase = 0.0;
+    double start, elapsed, legacy_fps, osc_fps;
+    unsigned long frames;
+
+    if (argc > 1)
+        rate = atoi(argv[1]);
+    if (argc > 2)
+        channels = atoi(argv[2]);
+    if (rate == 0 || channels == 0)
+    {
+        fprintf(stderr, "Usage: %s [rate] [channels]\n", argv[0]);
+        return 1;
+    }
+
+    buf = malloc(BENCH_PERIOD * channels * sizeof(short));
+    scratch = malloc(BENCH_PERIOD * sizeof(float));
+    if (buf == NULL || scratch == NULL)
+    {
+        fprintf(stderr, "No enough memory\n");
+        return 1;
+    }
+
+    frames = 0;
+    start = now();
+    do
+    {
+        legacy_period(buf, BENCH_PERIOD, &phase);
+        frames += BENCH_PERIOD;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    legacy_fps = frames / elapsed;
+
+    osc_init(&osc, freq, rate);
+    frames = 0;
+    start = now();
+    do
+    {
+        osc_period((short *)buf, scratch, BENCH_PERIOD, &osc);
+        frames += BENCH_PERIOD;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    osc_fps = frames / elapsed;
+
+    printf("rate %uHz, %u channels, S16_LE, period %d frames\n", rate, channels, BENCH_PERIOD);
+    printf("sin() per frame: %12.0f frames/s (%8.1fx realtime)\n", legacy_fps, legacy_fps / rate);
+    printf("oscillator:      %12.0f frames/s (%8.1fx realtime)\n", osc_fps, osc_fps / rate);
+    printf("speedup:         %12.2fx\n", osc_fps / legacy_fps);
+
+    free(scratch);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*************************************************************************
+ File Name: oscillator.h
+ Description: Sine oscillator shared by the playback demos
+ ************************************************************************/
+
+#ifndef OSCILLATOR_H
+#define OSCILLATOR_H
+
+/*
+ * Number of parallel rotators advanced per iteration. Every lane is one
+ * complex phasor, all lanes are rotated by the same constant, so the inner
+ * loop is a plain element-wise multiply-add which compilers vectorize.
+ */
+#define OSC_LANES       8
+
+struct oscillator
+{
+    double phase;       // phase of the next frame to render, [0, 2*pi)
+    double step;        // phase increment per frame
+};
+
+/*
+ * @brief           Initialize oscillator
+ * @out osc         Oscillator to initialize
+ * @in freq         Tone frequency(Hz)
+ * @in rate         Sample rate(Hz)
+ */
+void osc_init(struct oscillator *osc, double freq, unsigned int rate);
+
+/*
+ * @brief           Change frequency, keeping current phase (no click)
+ */
+void osc_set_freq(struct oscillator *osc, double freq, unsigned int rate);
+
+/*
+ * @brief           Render `count` frames of sine wave in [-1.0, 1.0]
+ * @in|out osc      Oscillator, phase is advanced by `count` frames
+ * @out out         Buffer holding at least `count` floats
+ * @in count        Frames to render
+ */
+void osc_render(struct oscillator *osc, float *out, unsigned int count);
+
+/*
+ * @brief           Like osc_render(), but accumulate `gain` * wave into `out`
+ */
+void osc_render_mix(struct oscillator *osc, float *out, unsigned int count, float gain);
+
+#endif
@@ -0,0 +1,234 @@
+/*************************************************************************
+ File Name: rt_thread.c
+ Description: Start a thread with real-time scheduling, locked memory and CPU affinity
+ ************************************************************************/
+
+/* CPU_SET, pthread_attr_setaffinity_np(), sched_getcpu() */
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <alloca.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "rt_thread.h"
+
+#define STACK_RESERVE   (64 * 1024)     // not prefaulted: the frames above, and below the guard page
+
+void rt_thread_attr_init(struct rt_thread_attr *attr)
+{
+    attr->policy = SCHED_FIFO;
+    attr->priority = 80;
+    attr->cpu = -1;
+    attr->lock_memory = 1;
+    attr->stack_size = RT_THREAD_STACK;
+    attr->probe_loops = RT_THREAD_PROBE_LOOPS;
+}
+
+static const char *policy_name(int policy)
+{
+    switch (policy)
+    {
+        case SCHED_FIFO:
+            return "SCHED_FIFO";
+        case SCHED_RR:
+            return "SCHED_RR";
+        case SCHED_OTHER:
+            return "SCHED_OTHER";
+        default:
+            return "unknown";
+    }
+}
+
+/* touch every page of the stack below the caller, so no page fault hits the loop later */
+static __attribute__((noinline)) void prefault_stack(size_t size)
+{
+    volatile unsigned char *p = alloca(size);
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    for (i = 0; i < size; i += page)
+        p[i] = 0;
+}
+
+static long timespec_diff_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+/* how late a periodic absolute timer wakes this thread up */
+static void probe_latency(struct rt_latency *lat, unsigned int loops)
+{
+    struct timespec next, now;
+    double sum = 0;
+    long ns;
+    unsigned int i;
+
+    lat->min = -1;
+    lat->max = 0;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (i = 0; i < loops; i++)
+    {
+        next.tv_nsec += RT_THREAD_PROBE_US * 1000;
+        if (next.tv_nsec >= 1000000000)
+        {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ns = timespec_diff_ns(&next, &now);
+        if (lat->min < 0 || ns < lat->min)
+            lat->min = ns;
+        if (ns > lat->max)
+            lat->max = ns;
+        sum += ns;
+    }
+    lat->count = loops;
+    lat->avg = loops ? sum / loops : 0;
+    if (loops == 0)
+        lat->min = 0;
+}
+
+static void *rt_thread_main(void *arg)
+{
+    struct rt_thread *t = arg;
+    struct sched_param param;
+
+    if (t->attr.stack_size > STACK_RESERVE)
+        prefault_stack(t->attr.stack_size - STACK_RESERVE);
+    if (pthread_getschedparam(pthread_self(), &t->policy, &param) == 0)
+        t->priority = param.sched_priority;
+    t->cpu = sched_getcpu();
+    if (t->attr.probe_loops)
+        probe_latency(&t->latency, t->attr.probe_loops);
+    sem_post(&t->ready);
+
+    return t->fn(t->arg);
+}
+
+/* warn early, pthread_create() would only say EPERM */
+static void check_rtprio(int policy, int priority)
+{
+    struct rlimit rlim;
+
+    if (policy == SCHED_OTHER || geteuid() == 0 || getrlimit(RLIMIT_RTPRIO, &rlim) < 0)
+        return;
+    if (rlim.rlim_cur == RLIM_INFINITY || (rlim_t)priority <= rlim.rlim_cur)
+        return;
+    fflush(stdout);
+    fprintf(stderr, "WARN: RLIMIT_RTPRIO is %lu, priority %d needs root, CAP_SYS_NICE or "
+            "\"rtprio %d\" in /etc/security/limits.conf\n", (unsigned long)rlim.rlim_cur, priority, priority);
+}
+
+static int create(struct rt_thread *t, int policy, int priority)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    cpu_set_t cpus;
+    int err;
+
+    /* CPU_SET() past the set would write out of it */
+    if (t->attr.cpu >= CPU_SETSIZE)
+        return EINVAL;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, t->attr.stack_size);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, policy);
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = policy == SCHED_OTHER ? 0 : priority;
+    pthread_attr_setschedparam(&attr, &param);
+    if (t->attr.cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(t->attr.cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    err = pthread_create(&t->thread, &attr, rt_thread_main, t);
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+int rt_thread_start(struct rt_thread *t, const struct rt_thread_attr *attr, void *(*fn)(void *), void *arg)
+{
+    int policy = attr->policy;
+    int err;
+
+    memset(t, 0, sizeof(*t));
+    t->attr = *attr;
+    if (t->attr.stack_size < (size_t)PTHREAD_STACK_MIN)
+        t->attr.stack_size = RT_THREAD_STACK;
+    t->fn = fn;
+    t->arg = arg;
+    t->cpu = -1;
+
+    check_rtprio(attr->policy, attr->priority);
+    if (attr->lock_memory)
+    {
+        /* MCL_FUTURE also locks the stack of the thread about to be created */
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+            t->locked = 1;
+        else
+        {
+            fflush(stdout);
+            fprintf(stderr, "WARN: mlockall failed: %s, check RLIMIT_MEMLOCK\n", strerror(errno));
+        }
+    }
+
+    sem_init(&t->ready, 0, 0);
+    err = create(t, policy, attr->priority);
+    if (err == EPERM && policy != SCHED_OTHER)
+    {
+        fflush(stdout);
+        fprintf(stderr, "WARN: %s priority %d not permitted, running with SCHED_OTHER\n",
+                policy_name(policy), attr->priority);
+        policy = SCHED_OTHER;
+        err = create(t, policy, attr->priority);
+    }
+    if (err == EINVAL && attr->cpu >= 0)
+    {
+        fflush(stdout);
+        fprintf(stderr, "WARN: cannot pin to CPU %d, running unpinned\n", attr->cpu);
+        t->attr.cpu = -1;
+        err = create(t, policy, attr->priority);
+    }
+    if (err != 0)
+    {
+        sem_destroy(&t->ready);
+        errno = err;
+        return -1;
+    }
+
+    while (sem_wait(&t->ready) < 0 && errno == EINTR)
+        ;
+    return 0;
+}
+
+int rt_thread_join(struct rt_thread *t, void **ret)
+{
+    int err = pthread_join(t->thread, ret);
+
+    sem_destroy(&t->ready);
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void rt_thread_report(const struct rt_thread *t, FILE *out)
+{
+    fprintf(out, "RT thread: %s priority %d, %s CPU %d, memory %slocked, %zu KiB stack prefaulted\n",
+            policy_name(t->policy), t->priority, t->attr.cpu >= 0 ? "pinned to" : "started on", t->cpu,
+            t->locked ? "" : "not ", t->attr.stack_size > STACK_RESERVE ? (t->attr.stack_size - STACK_RESERVE) / 1024 : 0);
+    if (t->latency.count)
+        fprintf(out, "RT thread: wakeup latency min %.1f, avg %.1f, max %.1f us over %u wakeups of %d us\n",
+                t->latency.min / 1e3, t->latency.avg / 1e3, t->latency.max / 1e3,
+                t->latency.count, RT_THREAD_PROBE_US);
+}
@@ -0,0 +1,80 @@
+/*************************************************************************
+ File Name: rt_thread.h
+ Description: Start a thread with real-time scheduling, locked memory and CPU affinity
+ ************************************************************************/
+
+#ifndef RT_THREAD_H
+#define RT_THREAD_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define RT_THREAD_STACK         (512 * 1024)    // default stack size
+#define RT_THREAD_PROBE_LOOPS   200             // default latency probe length
+#define RT_THREAD_PROBE_US      1000            // latency probe period
+
+struct rt_thread_attr
+{
+    int policy;                     // SCHED_FIFO, SCHED_RR or SCHED_OTHER
+    int priority;                   // 1-99 for SCHED_FIFO/SCHED_RR
+    int cpu;                        // CPU to pin to, -1 for any
+    int lock_memory;                // mlockall() current and future pages
+    size_t stack_size;              // prefaulted before the thread function runs
+    unsigned int probe_loops;       // timer wakeups to measure before the thread function runs, 0 for none
+};
+
+/* timer wakeup lateness, in ns */
+struct rt_latency
+{
+    unsigned int count;
+    long min;
+    long max;
+    double avg;
+};
+
+struct rt_thread
+{
+    pthread_t thread;
+    struct rt_thread_attr attr;     // as asked for
+    void *(*fn)(void *);
+    void *arg;
+    sem_t ready;                    // posted once the fields below are filled in
+
+    /* as got, filled in by the thread itself */
+    int policy;
+    int priority;
+    int cpu;                        // CPU it started on
+    int locked;                     // memory is locked
+    struct rt_latency latency;
+};
+
+/*
+ * @brief           SCHED_FIFO at priority 80, any CPU, memory locked, default stack, probe on
+ */
+void rt_thread_attr_init(struct rt_thread_attr *attr);
+
+/*
+ * @brief           Start thread running fn(arg)
+ *                  Checks RLIMIT_RTPRIO first and says what to change if the priority
+ *                  is not allowed. If the kernel still refuses the policy, the thread
+ *                  is started with SCHED_OTHER after a warning, rt_thread_report() tells.
+ *                  Before fn runs, the thread prefaults its stack and, if asked,
+ *                  measures its wakeup latency on a periodic timer; this call
+ *                  returns once that is done.
+ * @return          0 on success, -1 with errno set on failure
+ */
+int rt_thread_start(struct rt_thread *t, const struct rt_thread_attr *attr, void *(*fn)(void *), void *arg);
+
+/*
+ * @brief           Wait for the thread to end
+ * @out ret         Return value of fn, may be NULL
+ */
+int rt_thread_join(struct rt_thread *t, void **ret);
+
+/*
+ * @brief           Print policy, priority, CPU and observed latency
+ */
+void rt_thread_report(const struct rt_thread *t, FILE *out);
+
+#endif
@@ -0,0 +1,221 @@
+/*************************************************************************
+ File Name: sample_pack.c
+ Description: Float to PCM sample packers, one per snd_pcm_format_t
+ ************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+#include "sample_pack.h"
+
+/**********************
+ * Converters
+ *   Scale like the original generators did: truncate x * (2^(width-1) - 1),
+ *   unsigned formats flip the sign bit. The input is float, so 24/32 bit
+ *   output carries at most its 24 bit mantissa; scaling in double only
+ *   keeps the multiply from losing more.
+ **********************/
+#define CONV_S8(x)      ((uint8_t)(int8_t)((x) * 127.0f))
+#define CONV_U8(x)      ((uint8_t)(CONV_S8(x) ^ 0x80U))
+#define CONV_S16(x)     ((uint16_t)(int16_t)((x) * 32767.0f))
+#define CONV_U16(x)     ((uint16_t)(CONV_S16(x) ^ 0x8000U))
+#define CONV_S24(x)     ((uint32_t)(int32_t)((double)(x) * 8388607.0))
+#define CONV_U24(x)     ((uint32_t)((CONV_S24(x) ^ 0x800000U) & 0xffffffU))
+#define CONV_S32(x)     ((uint32_t)(int32_t)((double)(x) * 2147483647.0))
+#define CONV_U32(x)     ((uint32_t)(CONV_S32(x) ^ 0x80000000U))
+#define CONV_FLOAT(x)   float_bits(x)
+
+static inline uint32_t float_bits(float x)
+{
+    uint32_t v;
+
+    memcpy(&v, &x, sizeof(v));
+    return v;
+}
+
+/**********************
+ * Stores
+ *   Byte-wise with constant offsets, the compiler merges them into a single
+ *   (byte swapped if needed) store.
+ **********************/
+static inline void put_8(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+}
+
+static inline void put_le16(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void put_be16(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put_le24(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+}
+
+static inline void put_be24(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 16;
+    p[1] = v >> 8;
+    p[2] = v;
+}
+
+static inline void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/**********************
+ * Packers
+ *   One strided packer per format, plus two with the layout fixed at
+ *   compile time: a contiguous channel and interleaved channels sharing
+ *   the same samples. With a constant stride the byte stores merge and
+ *   -ftree-vectorize turns the loop into wide stores; with the stride a
+ *   variable it cannot.
+ **********************/
+#define DEFINE_PACKER(name, conv, put, bytes)                                       \
+static void pack_##name(void *dst, unsigned int step, const float *src, unsigned int count) \
+{                                                                                   \
+    unsigned char *p = dst;                                                         \
+    unsigned int n;                                                                 \
+                                                                                    \
+    for (n = 0; n < count; n++, p += step)                                          \
+    {                                                                               \
+        put(p, conv(src[n]));                                                       \
+    }                                                                               \
+}                                                                                   \
+                                                                                    \
+static void pack_##name##_contig(void *dst, unsigned int step __attribute__((unused)), \
+                                 const float *src, unsigned int count)              \
+{                                                                                   \
+    unsigned char *p = dst;                                                         \
+    unsigned int n;                                                                 \
+                                                                                    \
+    for (n = 0; n < count; n++, p += (bytes))                                       \
+    {                                                                               \
+        put(p, conv(src[n]));                                                       \
+    }                                                                               \
+}                                                                                   \
+                                                                                    \
+static void pack_##name##_ilv(void *dst, unsigned int channels, const float *src, unsigned int count) \
+{                                                                                   \
+    unsigned char *p = dst;                                                         \
+    unsigned int n, chn;                                                            \
+    uint32_t v;                                                                     \
+                                                                                    \
+    if (channels == 2)                                                              \
+    {                                                                               \
+        for (n = 0; n < count; n++, p += 2 * (bytes))                               \
+        {                                                                           \
+            v = conv(src[n]);                                                       \
+            put(p, v);                                                              \
+            put(p + (bytes), v);                                                    \
+        }                                                                           \
+        return;                                                                     \
+    }                                                                               \
+    for (n = 0; n < count; n++)                                                     \
+    {                                                                               \
+        v = conv(src[n]);                                                           \
+        for (chn = 0; chn < channels; chn++, p += (bytes))                          \
+        {                                                                           \
+            put(p, v);                                                              \
+        }                                                                           \
+    }                                                                               \
+}
+
+DEFINE_PACKER(s8,       CONV_S8,    put_8,      1)
+DEFINE_PACKER(u8,       CONV_U8,    put_8,      1)
+DEFINE_PACKER(s16_le,   CONV_S16,   put_le16,   2)
+DEFINE_PACKER(s16_be,   CONV_S16,   put_be16,   2)
+DEFINE_PACKER(u16_le,   CONV_U16,   put_le16,   2)
+DEFINE_PACKER(u16_be,   CONV_U16,   put_be16,   2)
+DEFINE_PACKER(s24_le,   CONV_S24,   put_le32,   4)
+DEFINE_PACKER(s24_be,   CONV_S24,   put_be32,   4)
+DEFINE_PACKER(u24_le,   CONV_U24,   put_le32,   4)
+DEFINE_PACKER(u24_be,   CONV_U24,   put_be32,   4)
+DEFINE_PACKER(s24_3le,  CONV_S24,   put_le24,   3)
+DEFINE_PACKER(s24_3be,  CONV_S24,   put_be24,   3)
+DEFINE_PACKER(u24_3le,  CONV_U24,   put_le24,   3)
+DEFINE_PACKER(u24_3be,  CONV_U24,   put_be24,   3)
+DEFINE_PACKER(s32_le,   CONV_S32,   put_le32,   4)
+DEFINE_PACKER(s32_be,   CONV_S32,   put_be32,   4)
+DEFINE_PACKER(u32_le,   CONV_U32,   put_le32,   4)
+DEFINE_PACKER(u32_be,   CONV_U32,   put_be32,   4)
+DEFINE_PACKER(float_le, CONV_FLOAT, put_le32,   4)
+DEFINE_PACKER(float_be, CONV_FLOAT, put_be32,   4)
+
+#define PACKERS(name, bytes)    { bytes, pack_##name, pack_##name##_contig, pack_##name##_ilv }
+
+static const struct
+{
+    snd_pcm_format_t format;
+    struct sample_packer packer;
+} packers[] = {
+    { SND_PCM_FORMAT_S8,        PACKERS(s8,         1) },
+    { SND_PCM_FORMAT_U8,        PACKERS(u8,         1) },
+    { SND_PCM_FORMAT_S16_LE,    PACKERS(s16_le,     2) },
+    { SND_PCM_FORMAT_S16_BE,    PACKERS(s16_be,     2) },
+    { SND_PCM_FORMAT_U16_LE,    PACKERS(u16_le,     2) },
+    { SND_PCM_FORMAT_U16_BE,    PACKERS(u16_be,     2) },
+    { SND_PCM_FORMAT_S24_LE,    PACKERS(s24_le,     4) },
+    { SND_PCM_FORMAT_S24_BE,    PACKERS(s24_be,     4) },
+    { SND_PCM_FORMAT_U24_LE,    PACKERS(u24_le,     4) },
+    { SND_PCM_FORMAT_U24_BE,    PACKERS(u24_be,     4) },
+    { SND_PCM_FORMAT_S24_3LE,   PACKERS(s24_3le,    3) },
+    { SND_PCM_FORMAT_S24_3BE,   PACKERS(s24_3be,    3) },
+    { SND_PCM_FORMAT_U24_3LE,   PACKERS(u24_3le,    3) },
+    { SND_PCM_FORMAT_U24_3BE,   PACKERS(u24_3be,    3) },
+    { SND_PCM_FORMAT_S32_LE,    PACKERS(s32_le,     4) },
+    { SND_PCM_FORMAT_S32_BE,    PACKERS(s32_be,     4) },
+    { SND_PCM_FORMAT_U32_LE,    PACKERS(u32_le,     4) },
+    { SND_PCM_FORMAT_U32_BE,    PACKERS(u32_be,     4) },
+    { SND_PCM_FORMAT_FLOAT_LE,  PACKERS(float_le,   4) },
+    { SND_PCM_FORMAT_FLOAT_BE,  PACKERS(float_be,   4) },
+};
+
+sample_pack_fn sample_pack_select(snd_pcm_format_t format)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(packers) / sizeof(packers[0]); i++)
+    {
+        if (packers[i].format == format)
+        {
+            return packers[i].packer.strided;
+        }
+    }
+    return NULL;
+}
+
+const struct sample_packer *sample_packer_select(snd_pcm_format_t format)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(packers) / sizeof(packers[0]); i++)
+    {
+        if (packers[i].format == format)
+        {
+            return &packers[i].packer;
+        }
+    }
+    return NULL;
+}
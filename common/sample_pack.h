@@ -0,0 +1,54 @@
+/*************************************************************************
+ File Name: sample_pack.h
+ Description: Float to PCM sample packers, one per snd_pcm_format_t
+ ************************************************************************/
+
+#ifndef SAMPLE_PACK_H
+#define SAMPLE_PACK_H
+
+#include <alsa/asoundlib.h>
+
+/*
+ * @brief           Convert float samples in [-1.0, 1.0] into one channel of a PCM area
+ * @out dst         Address of the first sample to write
+ * @in step         Distance between two consecutive samples of the channel(in byte)
+ * @in src          Float samples
+ * @in count        Count of samples
+ */
+typedef void (*sample_pack_fn)(void *dst, unsigned int step, const float *src, unsigned int count);
+
+/*
+ * @brief           Convert float samples into every channel of an interleaved PCM area,
+ *                  the same sample for each channel of a frame
+ * @out dst         Address of the first sample of the first channel
+ * @in channels     Count of channels, a frame is channels * sample size
+ * @in src          Float samples, one per frame
+ * @in count        Count of frames
+ */
+typedef void (*sample_pack_interleaved_fn)(void *dst, unsigned int channels, const float *src, unsigned int count);
+
+/*
+ * Packers of a format, one per area layout. The contiguous and interleaved
+ * ones have the stride fixed at compile time and vectorize.
+ */
+struct sample_packer
+{
+    unsigned int bytes;                     // physical sample size(in byte)
+    sample_pack_fn strided;                 // any step
+    sample_pack_fn contiguous;              // step == bytes only, step is ignored
+    sample_pack_interleaved_fn interleaved; // step == channels * bytes, channel n at n * bytes
+};
+
+/*
+ * @brief           Pick the packer of a format, done once per stream
+ * @return          Packer, or NULL if the format is not supported
+ */
+sample_pack_fn sample_pack_select(snd_pcm_format_t format);
+
+/*
+ * @brief           Pick all packers of a format, done once per stream
+ * @return          Packers, or NULL if the format is not supported
+ */
+const struct sample_packer *sample_packer_select(snd_pcm_format_t format);
+
+#endif
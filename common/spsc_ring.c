@@ -0,0 +1,31 @@
+/*************************************************************************
+ File Name: spsc_ring.c
+ Description: Lock-free single producer/single consumer ring of fixed size slots
+ ************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "spsc_ring.h"
+
+int spsc_ring_init(struct spsc_ring *ring, unsigned int nslots, size_t slot_size)
+{
+    unsigned int size = 1;
+
+    while (size < nslots)
+        size <<= 1;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->slot_size = (slot_size + sizeof(long double) - 1) / sizeof(long double) * sizeof(long double);
+    if (posix_memalign((void **)&ring->slots, SPSC_CACHELINE, (size_t)size * ring->slot_size) != 0)
+        return -1;
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void spsc_ring_free(struct spsc_ring *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+}
@@ -0,0 +1,95 @@
+/*************************************************************************
+ File Name: spsc_ring.h
+ Description: Lock-free single producer/single consumer ring of fixed size slots
+ ************************************************************************/
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define SPSC_CACHELINE  64
+
+/*
+ * Slots are written in place: the producer gets a slot with
+ * spsc_ring_write_slot(), fills it and publishes it with spsc_ring_write_commit().
+ * The consumer does the same with spsc_ring_read_slot()/spsc_ring_read_release().
+ * None of them ever blocks or locks, so either side may be a real-time thread.
+ */
+struct spsc_ring
+{
+    unsigned char *slots;
+    size_t slot_size;               // in byte, rounded up to keep slots aligned
+    unsigned int mask;              // slot count - 1, slot count is a power of 2
+    /* free running counters, index is counter & mask */
+    _Alignas(SPSC_CACHELINE) atomic_uint head;      // next slot to write, advanced by producer
+    _Alignas(SPSC_CACHELINE) atomic_uint tail;      // next slot to read, advanced by consumer
+};
+
+/*
+ * @brief           Allocate ring
+ * @in nslots       Slot count, rounded up to a power of 2
+ * @in slot_size    Size of one slot(in byte)
+ * @return          0 on success, -1 on no memory
+ */
+int spsc_ring_init(struct spsc_ring *ring, unsigned int nslots, size_t slot_size);
+void spsc_ring_free(struct spsc_ring *ring);
+
+static inline unsigned int spsc_ring_size(const struct spsc_ring *ring)
+{
+    return ring->mask + 1;
+}
+
+/*
+ * @brief           Slots filled and not yet released, safe to call from either side
+ */
+static inline unsigned int spsc_ring_fill(struct spsc_ring *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/*
+ * @brief           Producer: next free slot, or NULL if ring is full
+ */
+static inline void *spsc_ring_write_slot(struct spsc_ring *ring)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail > ring->mask)
+        return NULL;
+    return ring->slots + (size_t)(head & ring->mask) * ring->slot_size;
+}
+
+/*
+ * @brief           Producer: publish the slot got from spsc_ring_write_slot()
+ */
+static inline void spsc_ring_write_commit(struct spsc_ring *ring)
+{
+    atomic_fetch_add_explicit(&ring->head, 1, memory_order_release);
+}
+
+/*
+ * @brief           Consumer: oldest filled slot, or NULL if ring is empty
+ */
+static inline void *spsc_ring_read_slot(struct spsc_ring *ring)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail)
+        return NULL;
+    return ring->slots + (size_t)(tail & ring->mask) * ring->slot_size;
+}
+
+/*
+ * @brief           Consumer: give back the slot got from spsc_ring_read_slot()
+ */
+static inline void spsc_ring_read_release(struct spsc_ring *ring)
+{
+    atomic_fetch_add_explicit(&ring->tail, 1, memory_order_release);
+}
+
+#endif
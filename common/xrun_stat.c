@@ -0,0 +1,195 @@
+/*************************************************************************
+ File Name: xrun_stat.c
+ Description: Print the xrun stats blocks of running audio programs
+
+ Usage: xrun_stat [-i SECONDS] [-r EVENTS] [NAME...]
+   NAME is the shm name without prefix (my_capture.1234); all blocks
+   under /dev/shm are shown if none is given. The blocks are only read,
+   the audio programs are not disturbed.
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "xrun_stat.h"
+
+static const char *type_name[XT_NTYPES] = {"xrun", "suspend", "other"};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* consistent copy of a block being written, 0 on success */
+static int snapshot(const char *name, struct xt_stats *copy)
+{
+    char path[NAME_MAX + 1];
+    struct xt_stats *s;
+    unsigned int seq1, seq2;
+    int fd, tries;
+
+    snprintf(path, sizeof(path), "%s%s", XT_SHM_PREFIX, name);
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+    s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED)
+        return -1;
+
+    for (tries = 0; tries < 1000; tries++)
+    {
+        seq1 = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (seq1 & 1)
+            continue;
+        memcpy(copy, s, sizeof(*copy));
+        atomic_thread_fence(memory_order_acquire);
+        seq2 = atomic_load_explicit(&s->seq, memory_order_relaxed);
+        if (seq1 == seq2)
+            break;
+    }
+    munmap(s, sizeof(*s));
+    return tries < 1000 && copy->magic == XT_MAGIC && copy->version == XT_VERSION ? 0 : -1;
+}
+
+static void print_hist(const char *title, const char *unit, const uint64_t *hist)
+{
+    unsigned int b;
+
+    printf("  %-14s", title);
+    for (b = 0; b < XT_HIST_BUCKETS; b++)
+    {
+        if (hist[b] == 0)
+            continue;
+        if (b == 0)
+            printf(" <1%s:%llu", unit, (unsigned long long)hist[b]);
+        else if (b == 1)
+            printf(" 1%s:%llu", unit, (unsigned long long)hist[b]);
+        else if (b == XT_HIST_BUCKETS - 1)
+            printf(" >=%llu%s:%llu", 1ULL << (b - 1), unit, (unsigned long long)hist[b]);
+        else
+            printf(" %llu-%llu%s:%llu", 1ULL << (b - 1), (1ULL << b) - 1, unit, (unsigned long long)hist[b]);
+    }
+    printf("\n");
+}
+
+static void print_stats(const char *name, const struct xt_stats *s, unsigned int nrecent)
+{
+    uint64_t now = now_ns(), sec = now / 1000000000u;
+    uint32_t window[XT_NTYPES] = {0};
+    const struct xt_event *ev;
+    unsigned int i, type;
+    uint32_t n;
+
+    for (i = 0; i < XT_WINDOW; i++)
+    {
+        if (s->window[i].sec + XT_WINDOW <= sec)
+            continue;
+        for (type = 0; type < XT_NTYPES; type++)
+            window[type] += s->window[i].count[type];
+    }
+
+    printf("%s: up %.1f s\n", name, (now - s->start_ns) / 1e9);
+    printf("  ");
+    for (type = 0; type < XT_NTYPES; type++)
+        printf("%s %llu (%u in last %d s), ", type_name[type],
+               (unsigned long long)s->count[type], window[type], XT_WINDOW);
+    printf("recovered %llu, failed %llu, worst recovery %.3f ms\n",
+           (unsigned long long)s->recovered, (unsigned long long)s->failed, s->recovery_max_ns / 1e6);
+
+    print_hist("recovery", "us", s->recovery_us_hist);
+    print_hist("interval", "ms", s->interval_ms_hist);
+    printf("  %-14s", "fill");
+    for (i = 0; i < XT_FILL_BUCKETS; i++)
+    {
+        if (s->fill_hist[i])
+            printf(" %u-%u%%:%llu", i * 100 / XT_FILL_BUCKETS, (i + 1) * 100 / XT_FILL_BUCKETS,
+                   (unsigned long long)s->fill_hist[i]);
+    }
+    printf("\n");
+
+    n = s->recent_head < nrecent ? s->recent_head : nrecent;
+    if (n > XT_RECENT)
+        n = XT_RECENT;
+    for (i = s->recent_head - n; i != s->recent_head; i++)
+    {
+        ev = &s->recent[i % XT_RECENT];
+        printf("  [%10.3f s] %-7s stream %u fill %u/%u err %d, ",
+               (ev->ts_ns - s->start_ns) / 1e9, type_name[ev->type < XT_NTYPES ? ev->type : XT_OTHER],
+               ev->stream, ev->fill, ev->buffer_size, ev->err);
+        if (ev->recovery_ns == 0)
+            printf("recovering\n");
+        else if (ev->result < 0)
+            printf("recovery failed (%d) after %.3f ms\n", ev->result, ev->recovery_ns / 1e6);
+        else
+            printf("recovered in %.3f ms\n", ev->recovery_ns / 1e6);
+    }
+}
+
+static void show(const char *name, unsigned int nrecent)
+{
+    static struct xt_stats copy;
+
+    if (snapshot(name, &copy) < 0)
+        fprintf(stderr, "%s: no stats block\n", name);
+    else
+        print_stats(name, &copy, nrecent);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int interval = 0, nrecent = 8;
+    size_t prefix_len = strlen(XT_SHM_PREFIX) - 1;      // without leading '/'
+    struct dirent *de;
+    DIR *dir;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "i:r:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 'r':
+                nrecent = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i SECONDS] [-r EVENTS] [NAME...]\n", argv[0]);
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+
+    for (;;)
+    {
+        if (optind < argc)
+        {
+            for (i = optind; i < argc; i++)
+                show(argv[i], nrecent);
+        }
+        else if ((dir = opendir("/dev/shm")) != NULL)
+        {
+            while ((de = readdir(dir)) != NULL)
+            {
+                if (strncmp(de->d_name, XT_SHM_PREFIX + 1, prefix_len) == 0)
+                    show(de->d_name + prefix_len, nrecent);
+            }
+            closedir(dir);
+        }
+
+        if (interval == 0)
+            break;
+        printf("\n");
+        fflush(stdout);
+        sleep(interval);
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*************************************************************************
+ File Name: xrun_stat.h
+ Description: Layout of the shared memory xrun stats block
+ ************************************************************************/
+
+#ifndef XRUN_STAT_H
+#define XRUN_STAT_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * One block per process, in shared memory named XT_SHM_PREFIX<prog>.<pid>
+ * (i.e. /dev/shm/alsa_xrun.<prog>.<pid>). It is written by the audio
+ * thread only and read by anybody through a seqlock: `seq` is odd while
+ * an update is in progress, readers copy the block and retry if `seq`
+ * changed meanwhile. Readers never block the writer.
+ */
+#define XT_SHM_PREFIX       "/alsa_xrun."
+#define XT_MAGIC            0x58525354u     // "XRST"
+#define XT_VERSION          1
+
+#define XT_HIST_BUCKETS     20              // log2 buckets, bucket 0 is < 1 unit
+#define XT_FILL_BUCKETS     10              // tenths of the ring buffer
+#define XT_WINDOW           60              // rolling window, in seconds
+#define XT_RECENT           64              // last events kept
+
+enum xt_event_type
+{
+    XT_XRUN,                // underrun or overrun
+    XT_SUSPEND,
+    XT_OTHER,               // any other error handed to recovery
+    XT_NTYPES,
+};
+
+struct xt_event
+{
+    uint64_t ts_ns;         // CLOCK_MONOTONIC
+    uint64_t recovery_ns;   // 0 until recovered
+    uint32_t type;
+    uint32_t stream;        // index of the stream in the process
+    uint32_t fill;          // frames in the ring buffer at the event
+    uint32_t buffer_size;
+    int32_t err;            // error that triggered recovery
+    int32_t result;         // < 0 if recovery failed
+};
+
+struct xt_window
+{
+    uint64_t sec;           // CLOCK_MONOTONIC second this slot counts
+    uint32_t count[XT_NTYPES];
+};
+
+struct xt_stats
+{
+    uint32_t magic;
+    uint32_t version;
+    atomic_uint seq;
+    int32_t pid;
+    char prog[32];
+    uint64_t start_ns;
+
+    uint64_t count[XT_NTYPES];
+    uint64_t recovered;
+    uint64_t failed;
+    uint64_t recovery_max_ns;
+    uint64_t recovery_us_hist[XT_HIST_BUCKETS];     // recovery duration
+    uint64_t interval_ms_hist[XT_HIST_BUCKETS];     // time since previous event
+    uint64_t fill_hist[XT_FILL_BUCKETS];            // ring fill at the event
+
+    struct xt_window window[XT_WINDOW];             // indexed by second % XT_WINDOW
+
+    uint32_t recent_head;                           // events ever recorded
+    struct xt_event recent[XT_RECENT];              // indexed by n % XT_RECENT
+};
+
+/* log2 histogram bucket of `v` */
+static inline unsigned int xt_bucket(uint64_t v)
+{
+    unsigned int b = 0;
+
+    while (v > 0 && b < XT_HIST_BUCKETS - 1)
+    {
+        v >>= 1;
+        b++;
+    }
+    return b;
+}
+
+#endif
@@ -0,0 +1,175 @@
+/*************************************************************************
+ File Name: xrun_telemetry.c
+ Description: Record xrun/suspend/recovery events into a shared memory stats block
+ ************************************************************************/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "xrun_telemetry.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* seqlock, there is only one writer: the audio thread */
+static void xt_write_begin(struct xt_stats *s)
+{
+    atomic_store_explicit(&s->seq, atomic_load_explicit(&s->seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void xt_write_end(struct xt_stats *s)
+{
+    atomic_store_explicit(&s->seq, atomic_load_explicit(&s->seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+int xrun_telemetry_open(struct xrun_telemetry *t, const char *prog)
+{
+    const char *base = strrchr(prog, '/');
+    struct xt_stats *s;
+    int fd, err;
+
+    memset(t, 0, sizeof(*t));
+    base = base ? base + 1 : prog;
+    snprintf(t->shm_name, sizeof(t->shm_name), "%s%s.%d", XT_SHM_PREFIX, base, (int)getpid());
+
+    fd = shm_open(t->shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, sizeof(*s)) < 0)
+        goto fail;
+    s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s == MAP_FAILED)
+        goto fail;
+    close(fd);
+
+    /* touch every page now, not while recovering from an xrun */
+    memset(s, 0, sizeof(*s));
+    s->version = XT_VERSION;
+    s->pid = getpid();
+    snprintf(s->prog, sizeof(s->prog), "%s", base);
+    s->start_ns = now_ns();
+    atomic_init(&s->seq, 0);
+    /* readers check magic last */
+    atomic_thread_fence(memory_order_release);
+    s->magic = XT_MAGIC;
+
+    t->stats = s;
+    return 0;
+
+fail:
+    err = errno;
+    close(fd);
+    shm_unlink(t->shm_name);
+    errno = err;
+    return -1;
+}
+
+void xrun_telemetry_close(struct xrun_telemetry *t)
+{
+    if (t->stats == NULL)
+        return;
+    munmap(t->stats, sizeof(*t->stats));
+    shm_unlink(t->shm_name);
+    t->stats = NULL;
+}
+
+uint32_t xrun_telemetry_event(struct xrun_telemetry *t, snd_pcm_t *handle, unsigned int stream, int err)
+{
+    struct xt_stats *s = t->stats;
+    struct xt_event *ev;
+    struct xt_window *w;
+    snd_pcm_status_t *status;
+    snd_pcm_uframes_t buffer_size = 0, period_size, fill = 0, avail;
+    uint64_t now = now_ns(), sec;
+    unsigned int type, slot;
+    uint32_t id;
+
+    if (s == NULL)
+        return 0;
+
+    type = err == -EPIPE ? XT_XRUN : err == -ESTRPIPE ? XT_SUSPEND : XT_OTHER;
+
+    /* ring fill as the driver sees it now, frames queued for playback or waiting to be read */
+    snd_pcm_status_alloca(&status);
+    if (snd_pcm_get_params(handle, &buffer_size, &period_size) == 0 && snd_pcm_status(handle, status) == 0)
+    {
+        avail = snd_pcm_status_get_avail(status);
+        if (avail > buffer_size)
+            avail = buffer_size;
+        fill = snd_pcm_stream(handle) == SND_PCM_STREAM_CAPTURE ? avail : buffer_size - avail;
+    }
+
+    xt_write_begin(s);
+
+    id = s->recent_head++;
+    ev = &s->recent[id % XT_RECENT];
+    memset(ev, 0, sizeof(*ev));
+    ev->ts_ns = now;
+    ev->type = type;
+    ev->stream = stream;
+    ev->fill = fill;
+    ev->buffer_size = buffer_size;
+    ev->err = err;
+
+    s->count[type]++;
+    if (t->last_event_ns)
+        s->interval_ms_hist[xt_bucket((now - t->last_event_ns) / 1000000)]++;
+    if (buffer_size)
+    {
+        slot = fill * XT_FILL_BUCKETS / buffer_size;
+        s->fill_hist[slot < XT_FILL_BUCKETS ? slot : XT_FILL_BUCKETS - 1]++;
+    }
+
+    sec = now / 1000000000u;
+    w = &s->window[sec % XT_WINDOW];
+    if (w->sec != sec)
+    {
+        memset(w->count, 0, sizeof(w->count));
+        w->sec = sec;
+    }
+    w->count[type]++;
+
+    xt_write_end(s);
+
+    t->last_event_ns = now;
+    return id;
+}
+
+void xrun_telemetry_recovered(struct xrun_telemetry *t, uint32_t id, int result)
+{
+    struct xt_stats *s = t->stats;
+    struct xt_event *ev;
+    uint64_t dur;
+
+    /* gone, or already overwritten by newer events */
+    if (s == NULL || s->recent_head - id > XT_RECENT)
+        return;
+
+    ev = &s->recent[id % XT_RECENT];
+    dur = now_ns() - ev->ts_ns;
+
+    xt_write_begin(s);
+    ev->recovery_ns = dur ? dur : 1;
+    ev->result = result;
+    if (result < 0)
+    {
+        s->failed++;
+    }
+    else
+    {
+        s->recovered++;
+        s->recovery_us_hist[xt_bucket(dur / 1000)]++;
+        if (dur > s->recovery_max_ns)
+            s->recovery_max_ns = dur;
+    }
+    xt_write_end(s);
+}
@@ -0,0 +1,48 @@
+/*************************************************************************
+ File Name: xrun_telemetry.h
+ Description: Record xrun/suspend/recovery events into a shared memory stats block
+ ************************************************************************/
+
+#ifndef XRUN_TELEMETRY_H
+#define XRUN_TELEMETRY_H
+
+#include <alsa/asoundlib.h>
+#include <limits.h>
+#include "xrun_stat.h"
+
+struct xrun_telemetry
+{
+    struct xt_stats *stats;         // NULL if not open, all calls are then no-ops
+    char shm_name[NAME_MAX];
+    uint64_t last_event_ns;
+};
+
+/*
+ * @brief           Create and map the stats block of this process
+ * @in prog         Program name, part of the shm name
+ * @return          0 on success, -1 with errno set on failure
+ */
+int xrun_telemetry_open(struct xrun_telemetry *t, const char *prog);
+
+/*
+ * @brief           Unmap and remove the stats block
+ */
+void xrun_telemetry_close(struct xrun_telemetry *t);
+
+/*
+ * @brief           Record an event, call before trying to recover
+ * @in handle       PCM the error happened on, its status gives the ring fill
+ * @in stream       Index of the stream within the process
+ * @in err          Error about to be recovered from (-EPIPE, -ESTRPIPE, ...)
+ * @return          Event id, pass it to xrun_telemetry_recovered()
+ */
+uint32_t xrun_telemetry_event(struct xrun_telemetry *t, snd_pcm_t *handle, unsigned int stream, int err);
+
+/*
+ * @brief           Record the end of recovery of an event
+ * @in id           From xrun_telemetry_event()
+ * @in result       < 0 if recovery failed
+ */
+void xrun_telemetry_recovered(struct xrun_telemetry *t, uint32_t id, int result);
+
+#endif
@@ -14,10 +14,23 @@
 #include <sched.h>
 #include <errno.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/timerfd.h>
+#include <stdatomic.h>
+#include <linux/perf_event.h>
 //#include "../include/asoundlib.h"
 #include "alsa/asoundlib.h"
 #include <sys/time.h>
 #include <math.h>
+#include "oscillator.h"
+#include "sample_pack.h"
+#include "xrun_telemetry.h"
+#include "rt_thread.h"
 static char *device = "hw:0,0";                         /* playback device */
 static snd_pcm_format_t format = SND_PCM_FORMAT_S16;    /* sample format */
 static unsigned int rate = 44100;                       /* stream rate */
@@ -28,27 +41,50 @@ static double freq = 440;                               /* sinusoidal wave frequ
 static int verbose = 0;                                 /* verbose flag */
 static int resample = 1;                                /* enable alsa-lib resampling */
 static int period_event = 0;                            /* produce poll event after each period */
+static int tsched = 0;                                  /* timer scheduling, see tsched_loop() */
+static int period_wakeup = 1;                           /* period interrupts, tsched turns them off if it can */
+static unsigned int tsched_margin = 400000;             /* tsched wakes up with this much still queued, in us */
 static snd_pcm_sframes_t buffer_size;
 static snd_pcm_sframes_t period_size;
 static snd_output_t *output = NULL;
-static void generate_sine(const snd_pcm_channel_area_t *areas, 
-                          snd_pcm_uframes_t offset,
-                          int count, double *_phase)
+static const struct sample_packer *packer;              /* packers of the sample format */
+static float *wave;                                     /* one period of rendered sine wave */
+static struct xrun_telemetry telemetry;                 /* xrun stats, see common/xrun_stat */
+static const char *prog = "pcm";                        /* names the telemetry block */
+static unsigned int bench_seconds = 0;                  /* run every method this long, 0 to play */
+static volatile unsigned long bench_frames;             /* frames generated */
+static volatile unsigned long bench_xruns;              /* recoveries */
+static int rt_priority = 0;                             /* run the transfer loop on a real-time thread, 0 not to */
+static int rt_policy = SCHED_FIFO;                      /* its scheduling policy */
+static int rt_cpu = -1;                                 /* CPU to pin it to, -1 for any */
+/* each channel a plain array, as MMAP_NONINTERLEAVED gives */
+static int areas_contiguous(const snd_pcm_channel_area_t *areas, unsigned int width)
+{
+        unsigned int chn;
+        for (chn = 0; chn < channels; chn++)
+                if (areas[chn].step != width)
+                        return 0;
+        return 1;
+}
+/* one buffer, channels in order, no gaps */
+static int areas_interleaved(const snd_pcm_channel_area_t *areas, unsigned int width)
+{
+        unsigned int chn;
+        for (chn = 0; chn < channels; chn++)
+                if (areas[chn].addr != areas[0].addr ||
+                    areas[chn].first != areas[0].first + chn * width ||
+                    areas[chn].step != channels * width)
+                        return 0;
+        return 1;
+}
+/* fill the channel areas from the rendered wave */
+static void pack_wave(const snd_pcm_channel_area_t *areas,
+                      snd_pcm_uframes_t offset,
+                      int count)
 {
-        static double max_phase = 2. * M_PI;
-        double phase = *_phase;
-        double step = max_phase*freq/(double)rate;
         unsigned char *samples[channels];
         int steps[channels];
         unsigned int chn;
-        int format_bits = snd_pcm_format_width(format);
-        unsigned int maxval = (1 << (format_bits - 1)) - 1;
-        int bps = format_bits / 8;  /* bytes per sample */
-        int phys_bps = snd_pcm_format_physical_width(format) / 8;
-        int big_endian = snd_pcm_format_big_endian(format) == 1;
-        int to_unsigned = snd_pcm_format_unsigned(format) == 1;
-        int is_float = (format == SND_PCM_FORMAT_FLOAT_LE ||
-                        format == SND_PCM_FORMAT_FLOAT_BE);
         /* verify and prepare the contents of areas */
         for (chn = 0; chn < channels; chn++) {
                 if ((areas[chn].first % 8) != 0) {
@@ -63,36 +99,28 @@ static void generate_sine(const snd_pcm_channel_area_t *areas,
                 steps[chn] = areas[chn].step / 8;
                 samples[chn] += offset * steps[chn];
         }
-        /* fill the channel areas */
-        while (count-- > 0) {
-                union {
-                        float f;
-                        int i;
-                } fval;
-                int res, i;
-                if (is_float) {
-                        fval.f = sin(phase);
-                        res = fval.i;
-                } else
-                        res = sin(phase) * maxval;
-                if (to_unsigned)
-                        res ^= 1U << (format_bits - 1);
-                for (chn = 0; chn < channels; chn++) {
-                        /* Generate data in native endian format */
-                        if (big_endian) {
-                                for (i = 0; i < bps; i++)
-                                        *(samples[chn] + phys_bps - 1 - i) = (res >> i * 8) & 0xff;
-                        } else {
-                                for (i = 0; i < bps; i++)
-                                        *(samples[chn] + i) = (res >>  i * 8) & 0xff;
-                        }
-                        samples[chn] += steps[chn];
-                }
-                phase += step;
-                if (phase >= max_phase)
-                        phase -= max_phase;
+        if (areas_contiguous(areas, packer->bytes * 8)) {
+                for (chn = 0; chn < channels; chn++)
+                        packer->contiguous(samples[chn], steps[chn], wave, count);
+        } else if (areas_interleaved(areas, packer->bytes * 8)) {
+                packer->interleaved(samples[0], channels, wave, count);
+        } else {
+                for (chn = 0; chn < channels; chn++)
+                        packer->strided(samples[chn], steps[chn], wave, count);
         }
-        *_phase = phase;
+        bench_frames += count;
+}
+static void generate_sine(const snd_pcm_channel_area_t *areas, 
+                          snd_pcm_uframes_t offset,
+                          int count, double *_phase)
+{
+        struct oscillator osc;
+        /* render the wave once, then fill the channel areas */
+        osc.phase = *_phase;
+        osc_set_freq(&osc, freq, rate);
+        osc_render(&osc, wave, count);
+        pack_wave(areas, offset, count);
+        *_phase = osc.phase;
 }
 static int set_hwparams(snd_pcm_t *handle,
                         snd_pcm_hw_params_t *params,
@@ -166,6 +194,18 @@ static int set_hwparams(snd_pcm_t *handle,
                 return err;
         }
         period_size = size;
+        /* no period interrupts for timer scheduling, if the driver can do without */
+        if (tsched) {
+                if (snd_pcm_hw_params_can_disable_period_wakeup(params)) {
+                        err = snd_pcm_hw_params_set_period_wakeup(handle, params, 0);
+                        if (err < 0) {
+                                printf("Unable to disable period wakeups for playback: %s\n", snd_strerror(err));
+                                return err;
+                        }
+                        period_wakeup = 0;
+                } else
+                        printf("Period wakeups cannot be disabled, the timer runs besides them\n");
+        }
         /* write the parameters to device */
         err = snd_pcm_hw_params(handle, params);
         if (err < 0) {
@@ -205,6 +245,19 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
                         return err;
                 }
         }
+        /* timer scheduling wakes up by the position timestamp, on the timerfd clock */
+        if (tsched) {
+                err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE);
+                if (err < 0) {
+                        printf("Unable to set tstamp mode for playback: %s\n", snd_strerror(err));
+                        return err;
+                }
+                err = snd_pcm_sw_params_set_tstamp_type(handle, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+                if (err < 0) {
+                        printf("Unable to set tstamp type for playback: %s\n", snd_strerror(err));
+                        return err;
+                }
+        }
         /* write the parameters to the playback device */
         err = snd_pcm_sw_params(handle, swparams);
         if (err < 0) {
@@ -219,12 +272,16 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
  
 static int xrun_recovery(snd_pcm_t *handle, int err)
 {
+        uint32_t event = xrun_telemetry_event(&telemetry, handle, 0, err);
+
+        bench_xruns++;
         if (verbose)
                 printf("stream recovery\n");
         if (err == -EPIPE) {    /* under-run */
                 err = snd_pcm_prepare(handle);
                 if (err < 0)
                         printf("Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
+                xrun_telemetry_recovered(&telemetry, event, err);
                 return 0;
         } else if (err == -ESTRPIPE) {
                 while ((err = snd_pcm_resume(handle)) == -EAGAIN)
@@ -234,8 +291,10 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
                         if (err < 0)
                                 printf("Can't recovery from suspend, prepare failed: %s\n", snd_strerror(err));
                 }
+                xrun_telemetry_recovered(&telemetry, event, err);
                 return 0;
         }
+        xrun_telemetry_recovered(&telemetry, event, err);
         return err;
 }
 /*
@@ -698,6 +757,320 @@ static int direct_write_loop(snd_pcm_t *handle,
         }
 }
  
+/*
+ *   Transfer method - timer based scheduling
+ *
+ *   Period interrupts are off where the driver allows it. Each wakeup
+ *   fills all the room in the buffer, then arms a timerfd for the time
+ *   when, counted at nominal rate from the last position timestamp, only
+ *   the margin (-W) is left to play. The default margin is what
+ *   write_and_poll keeps queued when it wakes up with the default buffer
+ *   and period, 400 ms; so a late wakeup is absorbed as well as there.
+ *   The wakeups saved come from a larger buffer (-b): one per buffer
+ *   less the margin instead of one per period. A smaller margin saves
+ *   more with the same buffer, but leaves less time for a late wakeup.
+ */
+#define TSCHED_REPORT_S 10      /* seconds of audio between wakeup reports */
+
+static int tsched_fill(snd_pcm_t *handle, snd_pcm_uframes_t size, double *phase)
+{
+        const snd_pcm_channel_area_t *my_areas;
+        snd_pcm_uframes_t offset, frames;
+        snd_pcm_sframes_t commitres;
+        int err;
+        while (size > 0) {
+                /* the wave is rendered a period at a time */
+                frames = size < (snd_pcm_uframes_t)period_size ? size : (snd_pcm_uframes_t)period_size;
+                err = snd_pcm_mmap_begin(handle, &my_areas, &offset, &frames);
+                if (err < 0)
+                        return err;
+                generate_sine(my_areas, offset, frames, phase);
+                commitres = snd_pcm_mmap_commit(handle, offset, frames);
+                if (commitres < 0 || (snd_pcm_uframes_t)commitres != frames)
+                        return commitres >= 0 ? -EPIPE : commitres;
+                size -= frames;
+        }
+        return 0;
+}
+
+static int tsched_loop(snd_pcm_t *handle,
+                       signed short *samples ATTRIBUTE_UNUSED,
+                       snd_pcm_channel_area_t *areas ATTRIBUTE_UNUSED)
+{
+        double phase = 0;
+        struct itimerspec its;
+        snd_htimestamp_t tstamp;
+        snd_pcm_uframes_t hwavail;
+        snd_pcm_sframes_t avail, queued, margin;
+        unsigned long long frames = 0, wakeups = 0, polls, expirations;
+        unsigned long long report = (unsigned long long)rate * TSCHED_REPORT_S;
+        long long wake_ns;
+        int fd, err;
+        fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (fd < 0) {
+                printf("Unable to create timer: %s\n", strerror(errno));
+                return -errno;
+        }
+        /* at least a period of room to fill on every wakeup */
+        margin = (long long)tsched_margin * rate / 1000000;
+        if (margin > buffer_size - period_size) {
+                margin = buffer_size - period_size;
+                printf("Margin cut to %li frames, the buffer less a period; raise -b for a larger one\n", margin);
+        }
+        printf("Period wakeups %s, waking up with %li frames (%.1f ms) left\n",
+               period_wakeup ? "on" : "off", margin, 1000.0 * margin / rate);
+        memset(&its, 0, sizeof(its));
+        while (1) {
+                /* snd_pcm_avail() syncs the hardware pointer, there is no interrupt to */
+                avail = snd_pcm_avail(handle);
+                if (avail < 0) {
+                        if ((err = xrun_recovery(handle, avail)) < 0) {
+                                printf("avail failed: %s\n", snd_strerror(err));
+                                return err;
+                        }
+                        continue;
+                }
+                err = tsched_fill(handle, avail, &phase);
+                if (err < 0) {
+                        if ((err = xrun_recovery(handle, err)) < 0) {
+                                printf("MMAP error: %s\n", snd_strerror(err));
+                                exit(EXIT_FAILURE);
+                        }
+                        continue;
+                }
+                frames += avail;
+                if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+                        err = snd_pcm_start(handle);
+                        if (err < 0) {
+                                printf("Start error: %s\n", snd_strerror(err));
+                                exit(EXIT_FAILURE);
+                        }
+                        continue;       /* for a timestamp of the running stream */
+                }
+                /* room left and when the hardware pointer it counts from was read */
+                err = snd_pcm_htimestamp(handle, &hwavail, &tstamp);
+                if (err < 0 || (tstamp.tv_sec == 0 && tstamp.tv_nsec == 0)) {
+                        avail = snd_pcm_avail(handle);
+                        if (avail < 0)
+                                continue;
+                        hwavail = avail;
+                        clock_gettime(CLOCK_MONOTONIC, &tstamp);
+                }
+                queued = buffer_size - hwavail;
+                wake_ns = tstamp.tv_sec * 1000000000LL + tstamp.tv_nsec;
+                if (queued > margin)
+                        wake_ns += (queued - margin) * 1000000000LL / rate;
+                its.it_value.tv_sec = wake_ns / 1000000000LL;
+                its.it_value.tv_nsec = wake_ns % 1000000000LL;
+                if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+                        printf("Unable to arm timer: %s\n", strerror(errno));
+                        close(fd);
+                        return -errno;
+                }
+                while (read(fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR)
+                        ;
+                wakeups++;
+                if (frames >= report) {
+                        /* an estimate, one per period; -B measures both */
+                        polls = frames / period_size;
+                        printf("tsched: %llu wakeups in %.1fs with %.1f ms margin, write_and_poll estimated %llu, "
+                               "about %llu saved (%.1f%%)\n",
+                               wakeups, (double)frames / rate, 1000.0 * margin / rate, polls,
+                               polls > wakeups ? polls - wakeups : 0,
+                               polls ? 100.0 * ((double)polls - wakeups) / polls : 0.0);
+                        report += (unsigned long long)rate * TSCHED_REPORT_S;
+                }
+        }
+}
+ 
+/*
+ *   Transfer method - pull callback on a real-time thread
+ *
+ *   Like a JACK client: an engine thread waits on the poll descriptors and
+ *   hands every period of room to process(), which fills the mmap areas.
+ *   Unlike the async methods nothing runs in a signal handler, and no
+ *   other code gets interrupted. Controls are changed from the calling
+ *   thread and reach process() through atomics, the audio path never
+ *   takes a lock.
+ */
+typedef void (*process_fn)(snd_pcm_uframes_t frames,
+                           const snd_pcm_channel_area_t *areas,
+                           snd_pcm_uframes_t offset,
+                           void *arg);
+struct callback_engine {
+        snd_pcm_t *handle;
+        struct pollfd *ufds;
+        int count;
+        process_fn process;
+        void *arg;
+        atomic_int running;             /* cleared to stop the engine */
+        int err;
+};
+struct sine_controls {
+        _Atomic float freq;             /* Hz, set by the control thread */
+        _Atomic float gain;             /* linear, set by the control thread */
+        struct oscillator osc;          /* engine thread only */
+        float gain_now;                 /* engine thread only */
+};
+static void sine_process(snd_pcm_uframes_t frames,
+                         const snd_pcm_channel_area_t *areas,
+                         snd_pcm_uframes_t offset,
+                         void *arg)
+{
+        struct sine_controls *ctl = arg;
+        float gain = atomic_load_explicit(&ctl->gain, memory_order_relaxed);
+        float step = (gain - ctl->gain_now) / frames;
+        snd_pcm_uframes_t i;
+        osc_set_freq(&ctl->osc, atomic_load_explicit(&ctl->freq, memory_order_relaxed), rate);
+        osc_render(&ctl->osc, wave, frames);
+        /* ramp to a new gain over the block, no zipper noise */
+        if (step != 0 || gain != 1.0f)
+                for (i = 0; i < frames; i++)
+                        wave[i] *= ctl->gain_now + step * (i + 1);
+        ctl->gain_now = gain;
+        pack_wave(areas, offset, frames);
+}
+/* hand process() all the room there is, a period at a time */
+static int callback_fill(struct callback_engine *engine)
+{
+        const snd_pcm_channel_area_t *my_areas;
+        snd_pcm_uframes_t offset, frames, size;
+        snd_pcm_sframes_t avail, commitres;
+        int err;
+        avail = snd_pcm_avail_update(engine->handle);
+        if (avail < 0)
+                return avail;
+        while (avail >= period_size) {
+                size = period_size;
+                while (size > 0) {
+                        frames = size;
+                        err = snd_pcm_mmap_begin(engine->handle, &my_areas, &offset, &frames);
+                        if (err < 0)
+                                return err;
+                        engine->process(frames, my_areas, offset, engine->arg);
+                        commitres = snd_pcm_mmap_commit(engine->handle, offset, frames);
+                        if (commitres < 0 || (snd_pcm_uframes_t)commitres != frames)
+                                return commitres >= 0 ? -EPIPE : commitres;
+                        size -= frames;
+                }
+                avail -= period_size;
+        }
+        return 0;
+}
+static void *callback_thread(void *arg)
+{
+        struct callback_engine *engine = arg;
+        snd_pcm_t *handle = engine->handle;
+        snd_pcm_state_t state;
+        unsigned short revents;
+        int err;
+        while (atomic_load_explicit(&engine->running, memory_order_relaxed)) {
+                err = callback_fill(engine);
+                if (err < 0) {
+                        if ((err = xrun_recovery(handle, err)) < 0) {
+                                engine->err = err;
+                                break;
+                        }
+                        continue;
+                }
+                if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+                        err = snd_pcm_start(handle);
+                        if (err < 0) {
+                                engine->err = err;
+                                break;
+                        }
+                }
+                if (poll(engine->ufds, engine->count, -1) < 0) {
+                        /* revents would be the ones of the last poll() */
+                        if (errno == EINTR)
+                                continue;
+                        engine->err = -errno;
+                        break;
+                }
+                snd_pcm_poll_descriptors_revents(handle, engine->ufds, engine->count, &revents);
+                if (revents & POLLERR) {
+                        state = snd_pcm_state(handle);
+                        err = state == SND_PCM_STATE_XRUN ? -EPIPE :
+                              state == SND_PCM_STATE_SUSPENDED ? -ESTRPIPE : -EIO;
+                        if ((err = xrun_recovery(handle, err)) < 0) {
+                                engine->err = err;
+                                break;
+                        }
+                }
+        }
+        return NULL;
+}
+static int callback_loop(snd_pcm_t *handle,
+                         signed short *samples ATTRIBUTE_UNUSED,
+                         snd_pcm_channel_area_t *areas ATTRIBUTE_UNUSED)
+{
+        struct callback_engine engine;
+        struct sine_controls ctl;
+        struct rt_thread_attr attr;
+        struct rt_thread thread;
+        char line[64];
+        float value;
+        int err;
+        engine.count = snd_pcm_poll_descriptors_count(handle);
+        if (engine.count <= 0) {
+                printf("Invalid poll descriptors count\n");
+                return engine.count;
+        }
+        engine.ufds = malloc(sizeof(struct pollfd) * engine.count);
+        if (engine.ufds == NULL) {
+                printf("No enough memory\n");
+                return -ENOMEM;
+        }
+        if ((err = snd_pcm_poll_descriptors(handle, engine.ufds, engine.count)) < 0) {
+                printf("Unable to obtain poll descriptors for playback: %s\n", snd_strerror(err));
+                free(engine.ufds);
+                return err;
+        }
+        atomic_init(&ctl.freq, freq);
+        atomic_init(&ctl.gain, 1.0f);
+        osc_init(&ctl.osc, freq, rate);
+        ctl.gain_now = 1.0f;
+        engine.handle = handle;
+        engine.process = sine_process;
+        engine.arg = &ctl;
+        atomic_init(&engine.running, 1);
+        engine.err = 0;
+        /* real-time even without -R, that is what the engine is for */
+        rt_thread_attr_init(&attr);
+        if (rt_priority) {
+                attr.policy = rt_policy;
+                attr.priority = rt_priority;
+        }
+        attr.cpu = rt_cpu;
+        if (rt_thread_start(&thread, &attr, callback_thread, &engine) < 0) {
+                printf("Engine thread failed: %s\n", strerror(errno));
+                free(engine.ufds);
+                return -errno;
+        }
+        rt_thread_report(&thread, stdout);
+        /* the control side, until q; at end of input the engine just plays on */
+        if (!bench_seconds) {
+                printf("Controls: f HZ, g GAIN (0-1), q to stop\n");
+                while (fgets(line, sizeof(line), stdin)) {
+                        if (line[0] == 'q') {
+                                atomic_store_explicit(&engine.running, 0, memory_order_relaxed);
+                                break;
+                        }
+                        if (sscanf(line, "f %f", &value) == 1 && value >= 50 && value <= 5000)
+                                atomic_store_explicit(&ctl.freq, value, memory_order_relaxed);
+                        else if (sscanf(line, "g %f", &value) == 1 && value >= 0 && value <= 1)
+                                atomic_store_explicit(&ctl.gain, value, memory_order_relaxed);
+                        else
+                                printf("Controls: f HZ (50-5000), g GAIN (0-1), q to stop\n");
+                }
+        }
+        rt_thread_join(&thread, NULL);
+        free(engine.ufds);
+        if (engine.err < 0)
+                printf("Engine stopped: %s\n", snd_strerror(engine.err));
+        return engine.err;
+}
+ 
 /*
  *
  */
@@ -716,8 +1089,277 @@ static struct transfer_method transfer_methods[] = {
         { "direct_interleaved", SND_PCM_ACCESS_MMAP_INTERLEAVED, direct_loop },
         { "direct_noninterleaved", SND_PCM_ACCESS_MMAP_NONINTERLEAVED, direct_loop },
         { "direct_write", SND_PCM_ACCESS_MMAP_INTERLEAVED, direct_write_loop },
+        { "tsched", SND_PCM_ACCESS_MMAP_INTERLEAVED, tsched_loop },
+        { "callback", SND_PCM_ACCESS_MMAP_INTERLEAVED, callback_loop },
         { NULL, SND_PCM_ACCESS_RW_INTERLEAVED, NULL }
 };
+/*
+ *   Benchmark - every transfer method in turn, each in a child process
+ *
+ *   The child plays for bench_seconds, then SIGALRM ends it from whatever
+ *   the transfer loop is blocked in, and its counters go to the parent
+ *   through a pipe. The parent takes the child's CPU time and switches
+ *   from wait4() and subtracts what the child had used before the transfer
+ *   loop, so device setup is not included. Syscalls are counted with the
+ *   raw_syscalls:sys_enter tracepoint if perf allows, else by the
+ *   read/write class counters of /proc/self/io, which miss the ioctls.
+ */
+struct bench_result {
+        double user_s;                  /* CPU time; from the child, what setup used */
+        double sys_s;
+        long nvcsw;                     /* voluntary switches, i.e. wakeups after blocking */
+        long nivcsw;                    /* preemptions */
+        long long syscalls;             /* -1 if not counted */
+        unsigned long frames;
+        unsigned long xruns;
+};
+
+static int bench_pipe = -1;             /* child: write end of the result pipe */
+static int bench_perf = -1;             /* child: syscall counter, -1 if none */
+static struct bench_result bench_res;   /* child: rusage at the start of the transfer loop */
+static long long bench_syscalls0;
+
+static int bench_perf_open(void)
+{
+        static const char *paths[] = {
+                "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+        };
+        struct perf_event_attr attr;
+        unsigned int k;
+        FILE *fp;
+        int id = -1;
+
+        for (k = 0; k < sizeof(paths) / sizeof(paths[0]) && id < 0; k++) {
+                fp = fopen(paths[k], "r");
+                if (fp == NULL)
+                        continue;
+                if (fscanf(fp, "%d", &id) != 1)
+                        id = -1;
+                fclose(fp);
+        }
+        if (id < 0)
+                return -1;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = id;
+        attr.inherit = 1;
+        return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* it also runs in the SIGALRM handler, so only read() and no libc parsing */
+static long long bench_syscalls(void)
+{
+        char buf[512], *p;
+        long long count = 0, n1;
+        ssize_t n;
+        int fd;
+
+        if (bench_perf >= 0)
+                return read(bench_perf, &count, sizeof(count)) == sizeof(count) ? count : -1;
+        fd = open("/proc/self/io", O_RDONLY);
+        if (fd < 0)
+                return -1;
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0)
+                return -1;
+        buf[n] = 0;
+        for (p = buf; *p; p++) {
+                /* "syscr: N" and "syscw: N", each at the start of a line */
+                if ((p != buf && p[-1] != '\n') || p[0] != 's' || p[1] != 'y' ||
+                    p[2] != 's' || p[3] != 'c' || (p[4] != 'r' && p[4] != 'w') || p[5] != ':')
+                        continue;
+                for (p += 6; *p == ' '; p++)
+                        ;
+                for (n1 = 0; *p >= '0' && *p <= '9'; p++)
+                        n1 = n1 * 10 + (*p - '0');
+                count += n1;
+                if (!*p)
+                        break;
+        }
+        return count;
+}
+
+static double tv_sec(const struct timeval *tv)
+{
+        return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* SIGALRM handler: read(), write() and _exit() only, the parent
+ * gets the final rusage from wait4() */
+static void bench_stop(int sig ATTRIBUTE_UNUSED)
+{
+        struct bench_result res = bench_res;
+        long long syscalls = bench_syscalls();
+
+        res.syscalls = syscalls >= 0 && bench_syscalls0 >= 0 ? syscalls - bench_syscalls0 : -1;
+        res.frames = bench_frames;
+        res.xruns = bench_xruns;
+        if (write(bench_pipe, &res, sizeof(res)) != sizeof(res))
+                _exit(EXIT_FAILURE);
+        _exit(EXIT_SUCCESS);
+}
+
+/* child: called right before the transfer loop */
+static void bench_start(void)
+{
+        struct rusage ru;
+
+        signal(SIGALRM, bench_stop);
+        bench_perf = bench_perf_open();
+        bench_syscalls0 = bench_syscalls();
+        bench_frames = 0;
+        bench_xruns = 0;
+        getrusage(RUSAGE_SELF, &ru);
+        bench_res.user_s = tv_sec(&ru.ru_utime);
+        bench_res.sys_s = tv_sec(&ru.ru_stime);
+        bench_res.nvcsw = ru.ru_nvcsw;
+        bench_res.nivcsw = ru.ru_nivcsw;
+        alarm(bench_seconds);
+}
+
+static int play(int method);
+
+/*
+ *   Real-time thread - the transfer loop and the async handlers run on it
+ */
+
+struct transfer_args {
+        int method;
+        snd_pcm_t *handle;
+        signed short *samples;
+        snd_pcm_channel_area_t *areas;
+        int err;
+};
+
+static void *transfer_thread(void *arg)
+{
+        struct transfer_args *args = arg;
+        sigset_t sigs;
+        /* the starter blocked SIGIO, it is for this thread to handle */
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGIO);
+        pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+
+        if (bench_seconds)
+                bench_start();
+        args->err = transfer_methods[args->method].transfer_loop(args->handle, args->samples, args->areas);
+        return NULL;
+}
+
+static int transfer(struct transfer_args *args)
+{
+        struct rt_thread_attr attr;
+        struct rt_thread thread;
+        sigset_t sigs;
+        int err;
+
+        /* the callback method starts its own real-time thread */
+        if (!rt_priority || transfer_methods[args->method].transfer_loop == callback_loop) {
+                transfer_thread(args);
+                return args->err;
+        }
+        rt_thread_attr_init(&attr);
+        attr.policy = rt_policy;
+        attr.priority = rt_priority;
+        attr.cpu = rt_cpu;
+        /* SIGIO of the async methods is for the real-time thread to handle,
+         * blocked here before it starts; the thread unblocks it */
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGIO);
+        pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+        if (rt_thread_start(&thread, &attr, transfer_thread, args) < 0) {
+                err = -errno;
+                printf("Real-time thread failed: %s\n", strerror(errno));
+                pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+                return err;
+        }
+        rt_thread_report(&thread, stdout);
+        rt_thread_join(&thread, NULL);
+        return args->err;
+}
+
+static void bench_print(const char *name, int ok, const char *error, const struct bench_result *res, int last)
+{
+        double audio_s = ok ? (double)res->frames / rate : 0;
+
+        printf("    {\"method\": \"%s\", ", name);
+        if (!ok || audio_s <= 0) {
+                printf("\"error\": \"%s\"}%s\n", ok ? "no frames transferred" : error, last ? "" : ",");
+                return;
+        }
+        printf("\"audio_s\": %.3f, \"cpu_user_s\": %.6f, \"cpu_sys_s\": %.6f, "
+               "\"cpu_s_per_audio_s\": %.6f, \"ctx_switches_per_audio_s\": %.2f, "
+               "\"wakeups_per_audio_s\": %.2f, ",
+               audio_s, res->user_s, res->sys_s, (res->user_s + res->sys_s) / audio_s,
+               (res->nvcsw + res->nivcsw) / audio_s, res->nvcsw / audio_s);
+        if (res->syscalls >= 0)
+                printf("\"syscalls_per_audio_s\": %.2f, ", res->syscalls / audio_s);
+        else
+                printf("\"syscalls_per_audio_s\": null, ");
+        printf("\"xruns\": %lu, \"xruns_per_audio_s\": %.4f}%s\n",
+               res->xruns, res->xruns / audio_s, last ? "" : ",");
+}
+
+static int bench(void)
+{
+        struct bench_result res;
+        struct rusage ru;
+        char error[64];
+        int fds[2], status, devnull, k, ok, perf;
+        ssize_t n;
+        pid_t pid;
+
+        perf = bench_perf_open();
+        if (perf >= 0)
+                close(perf);
+        printf("{\n  \"device\": \"%s\", \"format\": \"%s\", \"rate\": %u, \"channels\": %u, "
+               "\"buffer_time_us\": %u, \"period_time_us\": %u, \"period_event\": %d, \"seconds\": %u,\n"
+               "  \"syscall_counter\": \"%s\",\n  \"methods\": [\n",
+               device, snd_pcm_format_name(format), rate, channels, buffer_time, period_time,
+               period_event, bench_seconds, perf >= 0 ? "perf" : "proc_io");
+        for (k = 0; transfer_methods[k].name; k++) {
+                if (pipe(fds) < 0) {
+                        perror("pipe");
+                        return -1;
+                }
+                fflush(stdout);
+                pid = fork();
+                if (pid < 0) {
+                        perror("fork");
+                        return -1;
+                }
+                if (pid == 0) {
+                        /* the transfer loops are chatty, only the JSON goes to stdout */
+                        close(fds[0]);
+                        bench_pipe = fds[1];
+                        devnull = open("/dev/null", O_WRONLY);
+                        if (devnull >= 0)
+                                dup2(devnull, STDOUT_FILENO);
+                        exit(play(k) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+                }
+                close(fds[1]);
+                n = read(fds[0], &res, sizeof(res));
+                close(fds[0]);
+                ok = wait4(pid, &status, 0, &ru) == pid && n == sizeof(res);
+                if (ok) {
+                        /* the child sent what it had used before the transfer loop */
+                        res.user_s = tv_sec(&ru.ru_utime) - res.user_s;
+                        res.sys_s = tv_sec(&ru.ru_stime) - res.sys_s;
+                        res.nvcsw = ru.ru_nvcsw - res.nvcsw;
+                        res.nivcsw = ru.ru_nivcsw - res.nivcsw;
+                }
+                if (WIFSIGNALED(status))
+                        snprintf(error, sizeof(error), "killed by signal %d", WTERMSIG(status));
+                else
+                        snprintf(error, sizeof(error), "exited with %d before the end", WEXITSTATUS(status));
+                bench_print(transfer_methods[k].name, ok, error, &res, transfer_methods[k + 1].name == NULL);
+        }
+        printf("  ]\n}\n");
+        return 0;
+}
 static void help(void)
 {
         int k;
@@ -735,6 +1377,14 @@ static void help(void)
 "-v,--verbose   show the PCM setup parameters\n"
 "-n,--noresample  do not resample\n"
 "-e,--pevent    enable poll event after each period\n"
+"-W,--margin    tsched: wake up with this much still queued in us,\n"
+"               400000 by default, as write_and_poll with -b/-p defaults\n"
+"-B,--bench     run every method this many seconds, print JSON\n"
+"               (device defaults to null then)\n"
+"-R,--rt        run the transfer loop on a real-time thread of this priority\n"
+"               (callback always has one, priority 80 by default)\n"
+"-P,--policy    its scheduling policy: fifo, rr or other\n"
+"-C,--cpu       CPU to pin it to\n"
 "\n");
         printf("Recognized sample formats are:");
         for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
@@ -764,22 +1414,21 @@ int main(int argc, char *argv[])
                 {"verbose", 1, NULL, 'v'},
                 {"noresample", 1, NULL, 'n'},
                 {"pevent", 1, NULL, 'e'},
+                {"bench", 1, NULL, 'B'},
+                {"rt", 1, NULL, 'R'},
+                {"policy", 1, NULL, 'P'},
+                {"cpu", 1, NULL, 'C'},
+                {"margin", 1, NULL, 'W'},
                 {NULL, 0, NULL, 0},
         };
-        snd_pcm_t *handle;
         int err, morehelp;
-        snd_pcm_hw_params_t *hwparams;
-        snd_pcm_sw_params_t *swparams;
         int method = 0;
-        signed short *samples;
-        unsigned int chn;
-        snd_pcm_channel_area_t *areas;
-        snd_pcm_hw_params_alloca(&hwparams);
-        snd_pcm_sw_params_alloca(&swparams);
+        int device_given = 0;
         morehelp = 0;
+        prog = argv[0];
         while (1) {
                 int c;
-                if ((c = getopt_long(argc, argv, "hD:r:c:f:b:p:m:o:vne", long_option, NULL)) < 0)
+                if ((c = getopt_long(argc, argv, "hD:r:c:f:b:p:m:o:vneB:R:P:C:W:", long_option, NULL)) < 0)
                         break;
                 switch (c) {
                 case 'h':
@@ -787,6 +1436,7 @@ int main(int argc, char *argv[])
                         break;
                 case 'D':
                         device = strdup(optarg);
+                        device_given = 1;
                         break;
                 case 'r':
                         rate = atoi(optarg);
@@ -846,6 +1496,40 @@ int main(int argc, char *argv[])
                 case 'e':
                         period_event = 1;
                         break;
+                case 'B':
+                        bench_seconds = atoi(optarg);
+                        bench_seconds = bench_seconds < 1 ? 1 : bench_seconds;
+                        break;
+                case 'R':
+                        rt_priority = atoi(optarg);
+                        rt_priority = rt_priority < 1 ? 1 : rt_priority;
+                        rt_priority = rt_priority > 99 ? 99 : rt_priority;
+                        break;
+                case 'P':
+                        if (!strcasecmp(optarg, "fifo"))
+                                rt_policy = SCHED_FIFO;
+                        else if (!strcasecmp(optarg, "rr"))
+                                rt_policy = SCHED_RR;
+                        else if (!strcasecmp(optarg, "other"))
+                                rt_policy = SCHED_OTHER;
+                        else {
+                                printf("Invalid scheduling policy %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                case 'W':
+                        tsched_margin = atoi(optarg);
+                        tsched_margin = tsched_margin < 1000 ? 1000 : tsched_margin;
+                        tsched_margin = tsched_margin > 1000000 ? 1000000 : tsched_margin;
+                        break;
+                case 'C':
+                        rt_cpu = atoi(optarg);
+                        if (rt_cpu >= sysconf(_SC_NPROCESSORS_CONF)) {
+                                printf("Invalid CPU %s\n", optarg);
+                                return 1;
+                        }
+                        rt_cpu = rt_cpu < 0 ? -1 : rt_cpu;
+                        break;
                 }
         }
         if (morehelp) {
@@ -857,13 +1541,36 @@ int main(int argc, char *argv[])
                 printf("Output failed: %s\n", snd_strerror(err));
                 return 0;
         }
+        if (bench_seconds) {
+                /* no hardware needed, and no two runs fight over one */
+                if (!device_given)
+                        device = "null";
+                return bench() < 0 ? EXIT_FAILURE : 0;
+        }
+        play(method);
+        return 0;
+}
+
+static int play(int method)
+{
+        struct transfer_args args;
+        snd_pcm_t *handle;
+        int err;
+        snd_pcm_hw_params_t *hwparams;
+        snd_pcm_sw_params_t *swparams;
+        signed short *samples;
+        unsigned int chn;
+        snd_pcm_channel_area_t *areas;
+        snd_pcm_hw_params_alloca(&hwparams);
+        snd_pcm_sw_params_alloca(&swparams);
         printf("Playback device is %s\n", device);
         printf("Stream parameters are %iHz, %s, %i channels\n", rate, snd_pcm_format_name(format), channels);
         printf("Sine wave rate is %.4fHz\n", freq);
         printf("Using transfer method: %s\n", transfer_methods[method].name);
+        tsched = transfer_methods[method].transfer_loop == tsched_loop;
         if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
                 printf("Playback open error: %s\n", snd_strerror(err));
-                return 0;
+                return err;
         }
         
         if ((err = set_hwparams(handle, hwparams, transfer_methods[method].access)) < 0) {
@@ -876,6 +1583,16 @@ int main(int argc, char *argv[])
         }
         if (verbose > 0)
                 snd_pcm_dump(handle, output);
+        packer = sample_packer_select(format);
+        if (packer == NULL) {
+                printf("Sample format %s not supported by generator\n", snd_pcm_format_name(format));
+                exit(EXIT_FAILURE);
+        }
+        wave = malloc(period_size * sizeof(float));
+        if (wave == NULL) {
+                printf("No enough memory\n");
+                exit(EXIT_FAILURE);
+        }
         samples = malloc((period_size * channels * snd_pcm_format_physical_width(format)) / 8);
         if (samples == NULL) {
                 printf("No enough memory\n");
@@ -892,11 +1609,21 @@ int main(int argc, char *argv[])
                 areas[chn].first = chn * snd_pcm_format_physical_width(format);
                 areas[chn].step = channels * snd_pcm_format_physical_width(format);
         }
-        err = transfer_methods[method].transfer_loop(handle, samples, areas);
+        /* a benchmark child never gets to close it, see bench_stop() */
+        if (!bench_seconds && xrun_telemetry_open(&telemetry, prog) < 0)
+                printf("No xrun telemetry: %s\n", strerror(errno));
+
+        args.method = method;
+        args.handle = handle;
+        args.samples = samples;
+        args.areas = areas;
+        err = transfer(&args);
         if (err < 0)
                 printf("Transfer failed: %s\n", snd_strerror(err));
+        xrun_telemetry_close(&telemetry);
         free(areas);
         free(samples);
+        free(wave);
         snd_pcm_close(handle);
-        return 0;
+        return err;
 }
@@ -0,0 +1,494 @@
+/*************************************************************************
+ File Name: capture_sink.c
+ Description: Record captured frames to disk from a separate writer thread
+ ************************************************************************/
+
+/* fallocate(), O_DIRECT */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "capture_sink.h"
+
+/* what is queued to writer */
+struct sink_ref
+{
+    unsigned int block;
+    unsigned int bytes;
+};
+
+static long timespec_diff_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+static inline unsigned char *sink_block(const struct capture_sink *sink, int block)
+{
+    return sink->pool + (size_t)block * SINK_BLOCK_SIZE;
+}
+
+/****************************
+ * Writer Thread
+ ****************************/
+
+/*
+ * Keep the file allocated ahead of the writes, so that extending it
+ * does not cost block allocation on every write. Given up on the
+ * first failure, e.g. the file system does not support it.
+ */
+static void sink_prealloc(struct capture_sink *sink, off_t end)
+{
+    if (sink->allocated < 0 || end <= sink->allocated)
+        return;
+    if (fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, sink->allocated, SINK_PREALLOC) < 0)
+    {
+        sink->allocated = -1;
+        return;
+    }
+    sink->allocated += SINK_PREALLOC;
+}
+
+static int sink_write_block(struct capture_sink *sink, const unsigned char *buf, size_t bytes)
+{
+    size_t len = bytes, done = 0;
+    ssize_t ret;
+
+    /* O_DIRECT wants whole sectors, tail is cut by ftruncate() on close */
+    if (sink->direct)
+        len = (bytes + SINK_ALIGN - 1) / SINK_ALIGN * SINK_ALIGN;
+
+    sink_prealloc(sink, sink->data_offset + sink->written + len);
+    while (done < len)
+    {
+        ret = pwrite(sink->fd, buf + done, len - done, sink->data_offset + sink->written + done);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += ret;
+    }
+    sink->written += bytes;
+    return 0;
+}
+
+static int sink_write_header(struct capture_sink *sink)
+{
+    wav_header_build(sink->header, sink->format, sink->channels, sink->rate, sink->written);
+    if (pwrite(sink->fd, sink->header, WAV_HEADER_SIZE, 0) != WAV_HEADER_SIZE)
+        return -1;
+    return 0;
+}
+
+/*
+ * Make the header cover what has been written so far. The data goes
+ * to disk first, so a crash leaves a header that is short, never long.
+ */
+static int sink_checkpoint(struct capture_sink *sink)
+{
+    if (fdatasync(sink->fd) < 0 || sink_write_header(sink) < 0)
+        return -1;
+    sink->checkpoint = sink->written;
+    return 0;
+}
+
+/* index records are small, stdio batches them, one flush per call */
+static int sink_write_stamps(struct capture_sink *sink)
+{
+    struct ts_index_rec *rec;
+    int64_t realtime_offset = 0;
+    int n = 0;
+
+    while ((rec = spsc_ring_read_slot(&sink->stamp_q)) != NULL)
+    {
+        /* sampled here, off the capture thread; NTP moves it by far less than a batch lasts */
+        if (n == 0)
+            realtime_offset = ts_index_realtime_offset();
+        rec->realtime_offset_ns = realtime_offset;
+        if (fwrite(rec, sizeof(*rec), 1, sink->index) != 1)
+            return -1;
+        spsc_ring_read_release(&sink->stamp_q);
+        sink->stamps++;
+        n++;
+    }
+    if (n > 0 && fflush(sink->index) != 0)
+        return -1;
+    return 0;
+}
+
+static void *sink_writer(void *arg)
+{
+    struct capture_sink *sink = arg;
+    struct sink_ref *ref;
+    unsigned int *free_slot;
+    unsigned int block, bytes;
+    int stop;
+
+    for (;;)
+    {
+        /* load stop first, so the last block queued before it is not missed */
+        stop = atomic_load(&sink->stop);
+        if (sink->index && !sink->write_err && sink_write_stamps(sink) < 0)
+            sink->write_err = errno;
+        ref = spsc_ring_read_slot(&sink->full_q);
+        if (ref == NULL)
+        {
+            if (stop)
+                break;
+            sem_wait(&sink->filled);
+            continue;
+        }
+        block = ref->block;
+        bytes = ref->bytes;
+        spsc_ring_read_release(&sink->full_q);
+
+        if (!sink->write_err && sink_write_block(sink, sink_block(sink, block), bytes) < 0)
+            sink->write_err = errno;
+        if (!sink->write_err && sink->wav && sink->written - sink->checkpoint >= SINK_CHECKPOINT &&
+            sink_checkpoint(sink) < 0)
+            sink->write_err = errno;
+
+        /* never full, free_q has room for every block */
+        free_slot = spsc_ring_write_slot(&sink->free_q);
+        *free_slot = block;
+        spsc_ring_write_commit(&sink->free_q);
+    }
+    return NULL;
+}
+
+/****************************
+ * Capture Thread
+ ****************************/
+
+static void sink_queue_block(struct capture_sink *sink)
+{
+    struct sink_ref *ref;
+    unsigned int queued;
+
+    ref = spsc_ring_write_slot(&sink->full_q);
+    ref->block = sink->cur;
+    ref->bytes = sink->cur_fill;
+    spsc_ring_write_commit(&sink->full_q);
+    sem_post(&sink->filled);
+
+    queued = spsc_ring_fill(&sink->full_q);
+    if (queued > sink->queued_max)
+        sink->queued_max = queued;
+    sink->cur = -1;
+    sink->cur_fill = 0;
+}
+
+/* caller has checked there are enough free blocks */
+static void sink_append(struct capture_sink *sink, const unsigned char *src, size_t bytes)
+{
+    unsigned int *free_slot;
+    size_t n;
+
+    while (bytes > 0)
+    {
+        if (sink->cur < 0)
+        {
+            free_slot = spsc_ring_read_slot(&sink->free_q);
+            sink->cur = *free_slot;
+            spsc_ring_read_release(&sink->free_q);
+        }
+        n = SINK_BLOCK_SIZE - sink->cur_fill;
+        if (n > bytes)
+            n = bytes;
+        memcpy(sink_block(sink, sink->cur) + sink->cur_fill, src, n);
+        sink->cur_fill += n;
+        src += n;
+        bytes -= n;
+        if (sink->cur_fill == SINK_BLOCK_SIZE)
+            sink_queue_block(sink);
+    }
+}
+
+/* all channels of a frame are next to each other, as in MMAP_INTERLEAVED */
+static int areas_interleaved(const snd_pcm_channel_area_t *areas, unsigned int channels, unsigned int sample_bits)
+{
+    unsigned int chn;
+
+    if (areas[0].first % 8 != 0)
+        return 0;
+    for (chn = 0; chn < channels; chn++)
+    {
+        if (areas[chn].addr != areas[0].addr ||
+            areas[chn].step != channels * sample_bits ||
+            areas[chn].first != areas[0].first + chn * sample_bits)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * The frames after a drop are stamped as well, so the gap shows in the
+ * index: the pending stamp, or else the last one queued, is moved on
+ * over the dropped frames at nominal rate.
+ */
+static void sink_stamp_skip(struct capture_sink *sink, snd_pcm_uframes_t frames)
+{
+    int64_t ns;
+
+    if (!sink->stamp_pending)
+    {
+        if (sink->stamp.htstamp_ns == 0)
+            return;             // nothing stamped yet
+        frames += sink->frames - sink->stamp.frame_pos;
+        sink->stamp_pending = 1;
+    }
+    ns = (int64_t)frames * 1000000000 / sink->rate;
+    sink->stamp.htstamp_ns += ns;
+    if (sink->stamp.audio_tstamp_ns)
+        sink->stamp.audio_tstamp_ns += ns;     // 0 stays "no audio clock"
+}
+
+static void sink_queue_stamp(struct capture_sink *sink)
+{
+    struct ts_index_rec *rec;
+
+    sink->stamp_pending = 0;
+    sink->stamp.frame_pos = sink->frames;
+    rec = spsc_ring_write_slot(&sink->stamp_q);
+    if (rec == NULL)
+    {
+        sink->stamps_lost++;
+        return;
+    }
+    *rec = sink->stamp;
+    spsc_ring_write_commit(&sink->stamp_q);
+    /* blocks may come too seldom to drain the stamps in time at low rates */
+    if (spsc_ring_fill(&sink->stamp_q) == SINK_STAMPS / 2)
+        sem_post(&sink->filled);
+}
+
+void capture_sink_write(struct capture_sink *sink, const snd_pcm_channel_area_t *areas,
+                        snd_pcm_uframes_t offset, snd_pcm_uframes_t frames)
+{
+    size_t frame_bytes = sink->channels * sink->sample_bytes;
+    size_t bytes = frames * frame_bytes;
+    size_t room;
+    const unsigned char *src;
+    unsigned char *dst;
+    snd_pcm_uframes_t i, n;
+    unsigned int chn;
+    struct timespec ts_start, ts_end;
+    long ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    /* drop whole frames only, or the file loses frame alignment */
+    room = (size_t)spsc_ring_fill(&sink->free_q) * SINK_BLOCK_SIZE;
+    if (sink->cur >= 0)
+        room += SINK_BLOCK_SIZE - sink->cur_fill;
+    if (room < bytes)
+    {
+        sink->dropped += frames;
+        if (sink->index)
+            sink_stamp_skip(sink, frames);
+        goto out;
+    }
+    if (sink->stamp_pending)
+        sink_queue_stamp(sink);
+    sink->frames += frames;
+
+    if (areas_interleaved(areas, sink->channels, sink->sample_bytes * 8))
+    {
+        src = (const unsigned char *)areas[0].addr + areas[0].first / 8 + offset * frame_bytes;
+        sink_append(sink, src, bytes);
+        goto out;
+    }
+
+    /* gather channel by channel into the stage buffer first */
+    while (frames > 0)
+    {
+        n = frames < sink->stage_frames ? frames : sink->stage_frames;
+        for (chn = 0; chn < sink->channels; chn++)
+        {
+            dst = sink->stage + chn * sink->sample_bytes;
+            for (i = 0; i < n; i++)
+            {
+                src = (const unsigned char *)areas[chn].addr + (areas[chn].first + (offset + i) * areas[chn].step) / 8;
+                memcpy(dst, src, sink->sample_bytes);
+                dst += frame_bytes;
+            }
+        }
+        sink_append(sink, sink->stage, n * frame_bytes);
+        offset += n;
+        frames -= n;
+    }
+
+out:
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    ns = timespec_diff_ns(&ts_start, &ts_end);
+    if (ns > sink->enqueue_max_ns)
+        sink->enqueue_max_ns = ns;
+}
+
+void capture_sink_stamp(struct capture_sink *sink, int64_t htstamp_ns, int64_t audio_ns)
+{
+    if (sink->index == NULL)
+        return;
+    sink->stamp.htstamp_ns = htstamp_ns;
+    sink->stamp.audio_tstamp_ns = audio_ns;
+    sink->stamp_pending = 1;
+}
+
+/****************************
+ * Open/Close
+ ****************************/
+
+int capture_sink_open(struct capture_sink *sink, const char *path, int flags, snd_pcm_format_t format,
+                      unsigned int channels, unsigned int rate, snd_pcm_uframes_t max_frames)
+{
+    char index_path[PATH_MAX];
+    unsigned int i, *free_slot;
+    int err;
+
+    memset(sink, 0, sizeof(*sink));
+    if ((flags & SINK_WAV) && !wav_format_supported(format))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    sink->fd = -1;
+    sink->cur = -1;
+    sink->wav = !!(flags & SINK_WAV);
+    sink->data_offset = sink->wav ? WAV_HEADER_SIZE : 0;
+    sink->format = format;
+    sink->rate = rate;
+    sink->channels = channels;
+    sink->sample_bytes = snd_pcm_format_physical_width(format) / 8;
+    sink->stage_frames = max_frames;
+    atomic_init(&sink->stop, 0);
+
+    if (flags & SINK_DIRECT)
+    {
+        sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (sink->fd < 0 && errno == EINVAL)
+        {
+            fflush(stdout);
+            fprintf(stderr, "WARN: O_DIRECT not supported for %s, using buffered IO\n", path);
+        }
+        else
+            sink->direct = 1;
+    }
+    if (sink->fd < 0)
+    {
+        sink->direct = 0;
+        sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (sink->fd < 0)
+        return -1;
+
+    if (posix_memalign((void **)&sink->pool, SINK_ALIGN, (size_t)SINK_BLOCKS * SINK_BLOCK_SIZE) != 0 ||
+        (sink->stage = malloc(max_frames * channels * sink->sample_bytes)) == NULL ||
+        spsc_ring_init(&sink->free_q, SINK_BLOCKS, sizeof(unsigned int)) < 0 ||
+        spsc_ring_init(&sink->full_q, SINK_BLOCKS, sizeof(struct sink_ref)) < 0 ||
+        (sink->wav && posix_memalign((void **)&sink->header, SINK_ALIGN, WAV_HEADER_SIZE) != 0) ||
+        ((flags & SINK_INDEX) && spsc_ring_init(&sink->stamp_q, SINK_STAMPS, sizeof(struct ts_index_rec)) < 0))
+    {
+        errno = ENOMEM;
+        goto fail;
+    }
+    if (flags & SINK_INDEX)
+    {
+        snprintf(index_path, sizeof(index_path), "%s%s", path, TS_INDEX_SUFFIX);
+        sink->index = ts_index_create(index_path, rate, channels * sink->sample_bytes, sink->data_offset);
+        if (sink->index == NULL)
+            goto fail;
+    }
+    /* a valid, empty WAV from the start */
+    if (sink->wav && sink_write_header(sink) < 0)
+        goto fail;
+    /* fault the pool in now, not in the capture loop */
+    memset(sink->pool, 0, (size_t)SINK_BLOCKS * SINK_BLOCK_SIZE);
+
+    for (i = 0; i < SINK_BLOCKS; i++)
+    {
+        free_slot = spsc_ring_write_slot(&sink->free_q);
+        *free_slot = i;
+        spsc_ring_write_commit(&sink->free_q);
+    }
+
+    sem_init(&sink->filled, 0, 0);
+    clock_gettime(CLOCK_MONOTONIC, &sink->ts_start);
+    err = pthread_create(&sink->writer, NULL, sink_writer, sink);
+    if (err != 0)
+    {
+        sem_destroy(&sink->filled);
+        errno = err;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    err = errno;
+    close(sink->fd);
+    free(sink->pool);
+    free(sink->stage);
+    free(sink->header);
+    if (sink->index)
+        fclose(sink->index);
+    spsc_ring_free(&sink->free_q);
+    spsc_ring_free(&sink->full_q);
+    spsc_ring_free(&sink->stamp_q);
+    errno = err;
+    return -1;
+}
+
+int capture_sink_close(struct capture_sink *sink)
+{
+    if (sink->cur >= 0 && sink->cur_fill > 0)
+        sink_queue_block(sink);
+    atomic_store(&sink->stop, 1);
+    sem_post(&sink->filled);
+    pthread_join(sink->writer, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &sink->ts_end);
+
+    /* drop O_DIRECT padding and what fallocate() reserved beyond the end, RIFF wants even chunks */
+    if (ftruncate(sink->fd, sink->data_offset + sink->written + (sink->wav ? sink->written & 1 : 0)) < 0 &&
+        !sink->write_err)
+        sink->write_err = errno;
+    if (sink->wav && sink_checkpoint(sink) < 0 && !sink->write_err)
+        sink->write_err = errno;
+    close(sink->fd);
+    if (sink->index && fclose(sink->index) != 0 && !sink->write_err)
+        sink->write_err = errno;
+    sink->index = NULL;
+
+    sem_destroy(&sink->filled);
+    spsc_ring_free(&sink->free_q);
+    spsc_ring_free(&sink->full_q);
+    spsc_ring_free(&sink->stamp_q);
+    free(sink->pool);
+    free(sink->stage);
+    free(sink->header);
+    sink->pool = NULL;
+    sink->stage = NULL;
+    sink->header = NULL;
+
+    return sink->write_err ? -1 : 0;
+}
+
+void capture_sink_report(const struct capture_sink *sink, FILE *out)
+{
+    double secs = timespec_diff_ns(&sink->ts_start, &sink->ts_end) / 1e9;
+
+    fprintf(out, "Sink: %lld bytes in %.2f s, %.2f MB/s sustained%s%s\n",
+            (long long)sink->written, secs,
+            secs > 0 ? sink->written / secs / 1e6 : 0.0,
+            sink->direct ? " (O_DIRECT)" : "",
+            !sink->wav ? "" : sink->data_offset + sink->written > UINT32_MAX ? ", RF64" : ", WAV");
+    fprintf(out, "Sink: worst enqueue %.1f us, max %u/%u blocks queued, %llu frames dropped\n",
+            sink->enqueue_max_ns / 1e3, sink->queued_max, SINK_BLOCKS, sink->dropped);
+    if (sink->stamps || sink->stamps_lost)
+        fprintf(out, "Sink: %lu timestamps indexed, %lu lost\n", sink->stamps, sink->stamps_lost);
+    if (sink->write_err)
+        fprintf(out, "Sink: write failed: %s\n", strerror(sink->write_err));
+}
@@ -0,0 +1,125 @@
+/*************************************************************************
+ File Name: capture_sink.h
+ Description: Record captured frames to disk from a separate writer thread
+ ************************************************************************/
+
+#ifndef CAPTURE_SINK_H
+#define CAPTURE_SINK_H
+
+#include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include "spsc_ring.h"
+#include "wav_writer.h"
+#include "ts_index.h"
+
+#define SINK_ALIGN          4096                // O_DIRECT alignment of buffer, size and file offset
+#define SINK_BLOCK_SIZE     (256 * 1024)        // one disk write
+#define SINK_BLOCKS         32                  // blocks in pool, power of 2
+#define SINK_PREALLOC       (64 << 20)          // fallocate() this much ahead of writes
+#define SINK_CHECKPOINT     (64 << 20)          // WAV header is brought up to date this often
+#define SINK_STAMPS         4096                // timestamps in flight to writer, power of 2
+
+/* capture_sink_open() flags */
+#define SINK_DIRECT         0x1                 // O_DIRECT
+#define SINK_WAV            0x2                 // WAV/RF64 container instead of raw frames
+#define SINK_INDEX          0x4                 // timestamp index into PATH.idx, see capture_sink_stamp()
+
+/*
+ * The capture thread copies every committed period once into a block from
+ * a preallocated pool. Full blocks are queued to the writer thread, written
+ * to disk and queued back as free. Neither queue locks, so the capture thread
+ * never waits on the file system; if the writer falls behind and the pool runs
+ * dry, the frames are dropped and counted instead.
+ */
+struct capture_sink
+{
+    int fd;
+    int direct;                     // fd opened with O_DIRECT
+    int wav;
+    unsigned char *header;          // WAV_HEADER_SIZE, aligned to SINK_ALIGN
+    off_t data_offset;              // where the frames start in the file
+    unsigned char *pool;            // SINK_BLOCKS * SINK_BLOCK_SIZE, aligned to SINK_ALIGN
+    struct spsc_ring free_q;        // block index, writer -> capture
+    struct spsc_ring full_q;        // struct sink_ref, capture -> writer
+    struct spsc_ring stamp_q;       // struct ts_index_rec, capture -> writer
+    FILE *index;                    // NULL without SINK_INDEX
+    sem_t filled;                   // posted for every block queued to writer
+    atomic_int stop;
+    pthread_t writer;
+
+    /* capture thread side */
+    snd_pcm_format_t format;
+    unsigned int rate;
+    unsigned int channels;
+    unsigned int sample_bytes;
+    unsigned char *stage;           // interleave buffer for non-contiguous areas
+    snd_pcm_uframes_t stage_frames;
+    int cur;                        // block being filled, -1 if none
+    size_t cur_fill;
+    unsigned long long frames;      // frames queued, position of the next one in the file
+    unsigned long long dropped;     // frames lost for no free block
+    unsigned long stamps_lost;      // for no room in stamp_q
+    struct ts_index_rec stamp;      // waiting for its frames, see capture_sink_stamp()
+    int stamp_pending;
+    long enqueue_max_ns;
+    unsigned int queued_max;
+
+    /* writer thread side */
+    off_t written;                  // frames written, in byte
+    off_t allocated;
+    off_t checkpoint;               // `written` the WAV header says
+    unsigned long stamps;           // records in index file
+    int write_err;                  // first failed write, errno
+    struct timespec ts_start;
+    struct timespec ts_end;
+};
+
+/*
+ * @brief           Create file and start writer thread
+ * @in path         File to record into, truncated
+ * @in flags        SINK_DIRECT: open with O_DIRECT, falls back to buffered IO if unsupported
+ *                  SINK_WAV: write WAV, RF64 once it outgrows 4GiB. The header is
+ *                  updated every SINK_CHECKPOINT bytes, after the data it covers
+ *                  is on disk, so the file stays playable after a crash
+ *                  SINK_INDEX: write timestamps passed to capture_sink_stamp() into PATH.idx
+ * @in format       Sample format of the captured stream
+ * @in channels     Channel count of the captured stream
+ * @in rate         Sample rate of the captured stream
+ * @in max_frames   Largest frame count passed to capture_sink_write()
+ * @return          0 on success, -1 with errno set on failure (EINVAL: format not possible in WAV)
+ */
+int capture_sink_open(struct capture_sink *sink, const char *path, int flags, snd_pcm_format_t format,
+                      unsigned int channels, unsigned int rate, snd_pcm_uframes_t max_frames);
+
+/*
+ * @brief           Queue frames just got from snd_pcm_mmap_begin(), call before committing them
+ * @in areas        Areas from snd_pcm_mmap_begin()
+ * @in offset       Offset from snd_pcm_mmap_begin()
+ * @in frames       Frames to be committed
+ */
+void capture_sink_write(struct capture_sink *sink, const snd_pcm_channel_area_t *areas,
+                        snd_pcm_uframes_t offset, snd_pcm_uframes_t frames);
+
+/*
+ * @brief           Record when the first frame of the next capture_sink_write() was captured.
+ *                  Goes to the index along with that write, or with the next one if it is
+ *                  dropped (moved on at nominal rate). No-op without SINK_INDEX
+ * @in htstamp_ns   CLOCK_MONOTONIC, from snd_pcm_status_get_htstamp()
+ * @in audio_ns     By the audio clock, from snd_pcm_status_get_audio_htstamp()
+ */
+void capture_sink_stamp(struct capture_sink *sink, int64_t htstamp_ns, int64_t audio_ns);
+
+/*
+ * @brief           Flush pending block, stop writer thread, trim file to the recorded length
+ * @return          0 on success, -1 if any write failed
+ */
+int capture_sink_close(struct capture_sink *sink);
+
+/*
+ * @brief           Print throughput and enqueue latency, call after capture_sink_close()
+ */
+void capture_sink_report(const struct capture_sink *sink, FILE *out);
+
+#endif
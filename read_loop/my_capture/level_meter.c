@@ -0,0 +1,187 @@
+/*************************************************************************
+ File Name: level_meter.c
+ Description: Per-channel peak/RMS/clip metering straight on mmap areas
+ ************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "level_meter.h"
+
+/* smallest multiple of nch that fills whole vectors of METER_LANES */
+static unsigned int lane_width(unsigned int nch)
+{
+    unsigned int width = nch;
+
+    while (width % METER_LANES != 0 && width + nch <= METER_MAX_WIDTH)
+        width += nch;
+    return width;
+}
+
+/* full is 2^(width-1): min maps to -1.0, both min and max count as clipped */
+#define CLIPPED(x, val_t, full)     (((x) >= (val_t)(full) - 1) | ((x) <= -(val_t)(full)))
+
+/**********************
+ * Kernels
+ *   name():            `n` contiguous samples of `nch` interleaved channels
+ *                      starting at channel `first_chn`; lane j always holds
+ *                      channel first_chn + j % nch.
+ *   name##_strided():  one channel of any other layout, scalar.
+ **********************/
+#define DEFINE_METER(name, type, val_t, acc_t, full)                                    \
+static void name(struct level_meter *meter, const void *buf, unsigned long n,           \
+                 unsigned int first_chn, unsigned int nch)                              \
+{                                                                                       \
+    const type *src = buf;                                                              \
+    acc_t sumsq[METER_MAX_WIDTH] = {0};                                                 \
+    val_t peak[METER_MAX_WIDTH] = {0};                                                  \
+    unsigned int clip[METER_MAX_WIDTH] = {0};                                           \
+    unsigned int width = lane_width(nch);                                               \
+    unsigned int j, chn;                                                                \
+    unsigned long i;                                                                    \
+    val_t x, a;                                                                         \
+                                                                                        \
+    for (i = 0; i + width <= n; i += width)                                             \
+    {                                                                                   \
+        for (j = 0; j < width; j++)                                                     \
+        {                                                                               \
+            x = src[i + j];                                                             \
+            a = x < 0 ? -x : x;                                                         \
+            sumsq[j] += (acc_t)x * x;                                                   \
+            peak[j] = a > peak[j] ? a : peak[j];                                        \
+            clip[j] += CLIPPED(x, val_t, full);                                         \
+        }                                                                               \
+    }                                                                                   \
+    for (j = 0; i + j < n; j++)                                                         \
+    {                                                                                   \
+        x = src[i + j];                                                                 \
+        a = x < 0 ? -x : x;                                                             \
+        sumsq[j] += (acc_t)x * x;                                                       \
+        peak[j] = a > peak[j] ? a : peak[j];                                            \
+        clip[j] += CLIPPED(x, val_t, full);                                             \
+    }                                                                                   \
+                                                                                        \
+    for (j = 0; j < width; j++)                                                         \
+    {                                                                                   \
+        chn = first_chn + j % nch;                                                      \
+        meter->sumsq[chn] += (double)sumsq[j] / ((double)(full) * (full));              \
+        if (peak[j] / (double)(full) > meter->peak[chn])                                \
+            meter->peak[chn] = peak[j] / (double)(full);                                \
+        meter->clip[chn] += clip[j];                                                    \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+static void name##_strided(struct level_meter *meter, const snd_pcm_channel_area_t *area, \
+                           snd_pcm_uframes_t offset, snd_pcm_uframes_t frames,          \
+                           unsigned int chn)                                            \
+{                                                                                       \
+    const unsigned char *p = (const unsigned char *)area->addr +                        \
+                             (area->first + offset * area->step) / 8;                   \
+    double sumsq = 0, peak = 0;                                                         \
+    snd_pcm_uframes_t i;                                                                \
+    val_t x, a;                                                                         \
+                                                                                        \
+    for (i = 0; i < frames; i++, p += area->step / 8)                                   \
+    {                                                                                   \
+        x = *(const type *)p;                                                           \
+        a = x < 0 ? -x : x;                                                             \
+        sumsq += (double)x * x;                                                         \
+        peak = a > peak ? a : peak;                                                     \
+        meter->clip[chn] += CLIPPED(x, val_t, full);                                    \
+    }                                                                                   \
+    meter->sumsq[chn] += sumsq / ((double)(full) * (full));                             \
+    if (peak / (full) > meter->peak[chn])                                               \
+        meter->peak[chn] = peak / (full);                                               \
+}
+
+DEFINE_METER(meter_s16, int16_t, int32_t, int64_t, 32768)
+DEFINE_METER(meter_s32, int32_t, int64_t, double, 2147483648.0)
+
+/**********************
+ * Meter
+ **********************/
+
+int level_meter_init(struct level_meter *meter, snd_pcm_format_t format,
+                     unsigned int channels, unsigned int rate, unsigned int publish_hz)
+{
+    if ((format != SND_PCM_FORMAT_S16 && format != SND_PCM_FORMAT_S32) ||
+        channels == 0 || channels > METER_MAX_CHANNELS || publish_hz == 0)
+        return -1;
+
+    memset(meter, 0, sizeof(*meter));
+    meter->format = format;
+    meter->channels = channels;
+    meter->publish_frames = rate / publish_hz ? rate / publish_hz : 1;
+    meter->reading.channels = channels;
+    return 0;
+}
+
+static void level_meter_publish(struct level_meter *meter)
+{
+    struct level_reading *r = &meter->reading;
+    unsigned int chn;
+
+    r->frames = meter->frames;
+    for (chn = 0; chn < meter->channels; chn++)
+    {
+        r->peak_db[chn] = 20 * log10(meter->peak[chn]);
+        r->rms_db[chn] = 10 * log10(meter->sumsq[chn] / meter->frames);
+        r->clipped[chn] = meter->clip[chn];
+    }
+
+    meter->frames = 0;
+    memset(meter->sumsq, 0, sizeof(meter->sumsq));
+    memset(meter->peak, 0, sizeof(meter->peak));
+    memset(meter->clip, 0, sizeof(meter->clip));
+}
+
+int level_meter_feed(struct level_meter *meter, const snd_pcm_channel_area_t *areas,
+                     snd_pcm_uframes_t offset, snd_pcm_uframes_t frames)
+{
+    unsigned int channels = meter->channels;
+    unsigned int bits = snd_pcm_format_physical_width(meter->format);
+    int s16 = meter->format == SND_PCM_FORMAT_S16;
+    const unsigned char *base;
+    unsigned int chn;
+    int interleaved = areas[0].first % 8 == 0;
+
+    for (chn = 0; chn < channels && interleaved; chn++)
+    {
+        interleaved = areas[chn].addr == areas[0].addr &&
+                      areas[chn].step == channels * bits &&
+                      areas[chn].first == areas[0].first + chn * bits;
+    }
+
+    if (interleaved)
+    {
+        base = (const unsigned char *)areas[0].addr + areas[0].first / 8 + offset * channels * bits / 8;
+        if (s16)
+            meter_s16(meter, base, frames * channels, 0, channels);
+        else
+            meter_s32(meter, base, frames * channels, 0, channels);
+    }
+    else
+    {
+        for (chn = 0; chn < channels; chn++)
+        {
+            base = (const unsigned char *)areas[chn].addr + areas[chn].first / 8 + offset * bits / 8;
+            if (areas[chn].step == bits && areas[chn].first % 8 == 0)
+            {
+                if (s16)
+                    meter_s16(meter, base, frames, chn, 1);
+                else
+                    meter_s32(meter, base, frames, chn, 1);
+            }
+            else if (s16)
+                meter_s16_strided(meter, &areas[chn], offset, frames, chn);
+            else
+                meter_s32_strided(meter, &areas[chn], offset, frames, chn);
+        }
+    }
+
+    meter->frames += frames;
+    if (meter->frames < meter->publish_frames)
+        return 0;
+    level_meter_publish(meter);
+    return 1;
+}
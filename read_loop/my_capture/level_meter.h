@@ -0,0 +1,66 @@
+/*************************************************************************
+ File Name: level_meter.h
+ Description: Per-channel peak/RMS/clip metering straight on mmap areas
+ ************************************************************************/
+
+#ifndef LEVEL_METER_H
+#define LEVEL_METER_H
+
+#include <alsa/asoundlib.h>
+
+#define METER_MAX_CHANNELS  32
+/*
+ * Samples accumulated side by side per iteration. Contiguous samples
+ * (one channel of a non-interleaved area, or all channels of an interleaved
+ * one) are summed into independent lanes with an element-wise loop the
+ * compiler vectorizes; lanes are folded into channels once per call.
+ */
+#define METER_LANES         16
+#define METER_MAX_WIDTH     128
+
+struct level_reading
+{
+    unsigned int channels;
+    unsigned long frames;                       // frames this reading covers
+    float peak_db[METER_MAX_CHANNELS];          // dBFS, -inf for silence
+    float rms_db[METER_MAX_CHANNELS];           // dBFS
+    unsigned long clipped[METER_MAX_CHANNELS];  // samples at full scale
+};
+
+struct level_meter
+{
+    snd_pcm_format_t format;
+    unsigned int channels;
+    unsigned long publish_frames;
+
+    /* since last reading, normalized to full scale */
+    unsigned long frames;
+    double sumsq[METER_MAX_CHANNELS];
+    double peak[METER_MAX_CHANNELS];
+    unsigned long clip[METER_MAX_CHANNELS];
+
+    struct level_reading reading;
+};
+
+/*
+ * @brief           Initialize meter
+ * @in format       SND_PCM_FORMAT_S16 or SND_PCM_FORMAT_S32 (native endian)
+ * @in channels     Up to METER_MAX_CHANNELS
+ * @in rate         Sample rate(Hz)
+ * @in publish_hz   Readings per second
+ * @return          0 on success, -1 if format or channels is not supported
+ */
+int level_meter_init(struct level_meter *meter, snd_pcm_format_t format,
+                     unsigned int channels, unsigned int rate, unsigned int publish_hz);
+
+/*
+ * @brief           Meter frames in place, call between snd_pcm_mmap_begin() and commit
+ * @in areas        Areas from snd_pcm_mmap_begin()
+ * @in offset       Offset from snd_pcm_mmap_begin()
+ * @in frames       Frames to meter
+ * @return          1 if meter->reading has just been updated, 0 otherwise
+ */
+int level_meter_feed(struct level_meter *meter, const snd_pcm_channel_area_t *areas,
+                     snd_pcm_uframes_t offset, snd_pcm_uframes_t frames);
+
+#endif
@@ -5,12 +5,27 @@
  Description: 
  ************************************************************************/
 
+/* RUSAGE_THREAD */
+#define _GNU_SOURCE
+
 #include <alsa/asoundlib.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/resource.h>
+#include <math.h>
+#include <limits.h>
+#include <getopt.h>
+#include "capture_sink.h"
+#include "rt_log.h"
+#include "level_meter.h"
+#include "vad_gate.h"
+#include "xrun_telemetry.h"
 
 #define VERBOSE_LOG
 
+/* Sleep a bit longer than a period in every loop to provoke over-run */
+//#define FORCE_OVERRUN
+
 /****************************
  * Global Variables
  ****************************/
@@ -31,9 +46,29 @@ static snd_pcm_sframes_t period_size;
 /* SW Param */
 static unsigned int start_threshold_factor         = 0;
 
+/* Refuse period/buffer/rate the device can only approximate */
+static int strict_params                           = 1;
+
+/* Where prepare_device() reports and dumps, stdout if NULL */
+static FILE *info_out                              = NULL;
+
 /* Capture toggle */
 static volatile sig_atomic_t signal_pause_switch   = 1;
 
+/* What to do with the captured frames */
+static const char *output                          = NULL;
+static int direct                                  = 0;
+static int wav                                     = 0;
+static int index_output                            = 0;
+static int gate_on                                 = 0;
+static float gate_db                               = -50;
+static int gate_spectral                           = 0;
+static unsigned int meter_hz                       = 0;
+
+/* Log of the capture loop, formatted and printed by its own thread */
+static struct rt_log cap_log;
+#define LOG(fmt, ...)   RT_LOG(&cap_log, fmt, ##__VA_ARGS__)
+
 /****************************
  * Helper Functions
  ****************************/
@@ -48,14 +83,10 @@ void dump_areainfo(const snd_pcm_channel_area_t* areas)
 {
     int chn;
 
-    fprintf(stdout, "Area Info:\n");
     for (chn = 0; chn < channel; chn++)
     {
-        fprintf(stdout, "Channe %d:", chn);
-        fprintf(stdout, "Base address: %p\n", areas[chn].addr);
-        fprintf(stdout, "Offset to first sample: %u(bit)\n", areas[chn].first);
-        fprintf(stdout, "Sample distance: %u(bit)\n", areas[chn].step);
-        fputs("\n", stdout);
+        LOG("Channel %ld: base address: %#lx, offset to first sample: %lu(bit), sample distance: %lu(bit)",
+            chn, (long)areas[chn].addr, areas[chn].first, areas[chn].step);
     }
 }
 
@@ -128,6 +159,19 @@ void toggle(int sig)
     signal_pause_switch = signal_pause_switch? 0:1;
 }
 
+static void stop_log(void)
+{
+    rt_log_stop(&cap_log);
+}
+
+/* Xrun/suspend events, readable by xrun_stat while we run */
+static struct xrun_telemetry telemetry;
+
+static void close_telemetry(void)
+{
+    xrun_telemetry_close(&telemetry);
+}
+
 /****************************
  * ALSA Related
  ****************************/
@@ -137,8 +181,6 @@ void toggle(int sig)
  */
 static int xrun_recovery(snd_pcm_t* handle, int err)
 {
-    int ret = 0;
-
     switch (err)
     {
         case (-EPIPE):
@@ -152,14 +194,12 @@ static int xrun_recovery(snd_pcm_t* handle, int err)
             }
             break;
         case (-ESTRPIPE):
+            /* one try only, the capture loop waits for resume with resume_stream() instead */
             fflush(stdout);
-            fputs("WANR: Suspended! Try to prepare...\n", stderr);
-            while ((err = snd_pcm_resume(handle)) != -EAGAIN)
-            {
-                fflush(stdout);
-                fputs("\tTry again in 10ms\n", stderr);
-                usleep(100000);
-            }
+            fputs("WANR: Suspended! Try to resume...\n", stderr);
+            err = snd_pcm_resume(handle);
+            if (err < 0)
+                err = snd_pcm_prepare(handle);
             if (err < 0)
             {
                 pr_error("Can't recover from suspended, prepare failed", err);
@@ -185,22 +225,24 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     snd_pcm_stream_t stream     = SND_PCM_STREAM_CAPTURE;
 
     /* HW Params */
-    snd_pcm_hw_params_t* hw_params;
+    snd_pcm_hw_params_t* hw_params = NULL;
 
     /* SW Params */
-    snd_pcm_sw_params_t* sw_params;
+    snd_pcm_sw_params_t* sw_params = NULL;
 
-    int err;
+    int err, ret = 1;
     snd_pcm_uframes_t size;
-    snd_output_t* snd_out;  // used for dumping PCM info
+    snd_output_t* snd_out = NULL;   // used for dumping PCM info
+    FILE *info = info_out ? info_out : stdout;
 
     /* 1. Open PCM device */
+    *handle = NULL;
     err = snd_pcm_open(handle, device_name, stream, 0);
     if (err < 0) 
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_open failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
 
     /* 2. Set HW Params */
@@ -209,7 +251,7 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_hw_params_malloc failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
 
     // 2.1 init hw params
@@ -218,7 +260,7 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_hw_params_any failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
 
     // 2.2 access type
@@ -227,14 +269,14 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "%s not supported\n", snd_pcm_access_name(access_type));
-        return 1;
+        goto out;
     }
     err = snd_pcm_hw_params_set_access(*handle, hw_params, access_type);
     if (err < 0) 
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_hw_params_set_access failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
 
     // 2.3 stream param
@@ -245,7 +287,7 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_hw_params_set_format failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
 
     // 2.3.2 channel
@@ -255,13 +297,13 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_hw_params_set_channels_near failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
     if (channel != channel_expect)
     {
         fflush(stdout);
         fprintf(stderr, "WARN:HW:channel:\n\tExpect: %d\n\tApprox: %d\n", channel_expect, channel);
-        return 1;
+        goto out;
     }
 
     // 2.3.3 rate
@@ -271,13 +313,14 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_hw_params_set_rate_near failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
     if (rate != rate_expect)
     {
         fflush(stdout);
         fprintf(stderr, "WARN:HW:rate:\n\tExpect: %d\n\tApprox: %d\n",  rate_expect, rate);
-        return 1;
+        if (strict_params)
+            goto out;
     }
 
     // 2.4 buffer param
@@ -289,19 +332,20 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_hw_params_set_period_time_near failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
     if (period_time != period_time_expect)
     {
         fflush(stdout);
         fprintf(stderr, "WARN:HW:period_time:\n\tExpect: %d\n\tApprox: %d\n", period_time_expect, period_time);
-        return 1;
+        if (strict_params)
+            goto out;
     }
     err = snd_pcm_hw_params_get_period_size(hw_params, &size, 0);
     if (err < 0)
     {
         pr_error("snd_pcm_hw_params_get_period_size failed", err);
-        return 1;
+        goto out;
     }
     period_size = size;
 
@@ -312,19 +356,20 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_hw_params_set_periods_near failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
     if (periods != periods_expect)
     {
         fflush(stdout);
         fprintf(stderr, "WARN:HW:periods:\n\tExpect: %d\n\tApprox: %d\n", periods_expect, periods);
-        return 1;
+        if (strict_params)
+            goto out;
     }
     err = snd_pcm_hw_params_get_buffer_size(hw_params, &size);
     if (err < 0)
     {
         pr_error("snd_pcm_hw_params_get_buffer_size failed", err);
-        return 1;
+        goto out;
     }
     buffer_size = size;
 
@@ -334,7 +379,7 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     if (err < 0)
     {
         fprintf(stderr, "snd_pcm_hw_params_set_buffer_time_near failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
     if (buffer_time != buffer_time_expect)
     {
@@ -348,11 +393,11 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_hw_paramsfailed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
     else
     {
-        fprintf(stdout, "Set HW parameters finished\n");
+        fprintf(info, "Set HW parameters finished\n");
     }
 
     //dump_period_info(hw_params);
@@ -363,7 +408,7 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_sw_params_malloc failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
 
     // 3.1 init sw params
@@ -371,7 +416,8 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     if (err < 0) {
             fflush(stdout);
             fprintf(stderr, "snd_pcm_params_current failed: %s\n", snd_strerror(err));
-            return err;
+            ret = err;
+            goto out;
     }
 
     // 3.2 start threshold
@@ -380,52 +426,711 @@ int prepare_device(const char* device_name, snd_pcm_t **handle)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_sw_params_set_start_threshold failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
     
-    // 3.3 set params
+    // 3.3 driver timestamps for the index, in the clock ts_index.h expects
+    if (index_output)
+    {
+        err = snd_pcm_sw_params_set_tstamp_mode(*handle, sw_params, SND_PCM_TSTAMP_ENABLE);
+        if (err < 0)
+        {
+            fflush(stdout);
+            fprintf(stderr, "snd_pcm_sw_params_set_tstamp_mode failed: %s\n", snd_strerror(err));
+            goto out;
+        }
+        err = snd_pcm_sw_params_set_tstamp_type(*handle, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+        if (err < 0)
+        {
+            fflush(stdout);
+            fprintf(stderr, "snd_pcm_sw_params_set_tstamp_type failed: %s\n", snd_strerror(err));
+            goto out;
+        }
+    }
+
+    // 3.4 set params
     err = snd_pcm_sw_params(*handle, sw_params);
     if (err < 0)
     {
         fflush(stdout);
         fprintf(stderr, "snd_pcm_sw_params failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
     else
     {
-        fprintf(stdout, "Set SW parameters finished\n");
+        fprintf(info, "Set SW parameters finished\n");
     }
 
     /* 4. Dump PCM information */
-    err = snd_output_stdio_attach(&snd_out, stdout, 0);
+    err = snd_output_stdio_attach(&snd_out, info, 0);
     if (err < 0)
     {
         fflush(stdout);
         fprintf(stderr, "snd_output_stdio_attach failed: %s\n", snd_strerror(err));
-        return 1;
+        goto out;
     }
     // 4.1 hw info
-    fprintf(stdout, "\n- HW Params -\n");
+    fprintf(info, "\n- HW Params -\n");
     snd_pcm_hw_params_dump(hw_params, snd_out);
     // 4.2 sw info
-    fprintf(stdout, "\n- SW Params -\n");
+    fprintf(info, "\n- SW Params -\n");
     snd_pcm_sw_params_dump(sw_params, snd_out);
-    fprintf(stdout, "\n");
+    fprintf(info, "\n");
+    ret = 0;
+
+out:
+    /* 5. Free memory, on failure too: a sweep prepares again and again */
+    if (snd_out)
+        snd_output_close(snd_out);
+    if (hw_params)
+        snd_pcm_hw_params_free(hw_params);
+    if (sw_params)
+        snd_pcm_sw_params_free(sw_params);
+
+    return ret;
+}
+
+/****************************
+ * Parameter Sweep
+ ****************************/
+
+/* grid walked by sweep(), every combination is one point */
+static const snd_pcm_access_t sweep_access[]       = {SND_PCM_ACCESS_MMAP_INTERLEAVED, SND_PCM_ACCESS_RW_INTERLEAVED};
+static const unsigned int sweep_period_time[]      = {1000, 2000, 5000, 10000, 20000, 50000};
+static const unsigned int sweep_periods[]          = {2, 3, 4, 8};
+static const unsigned int sweep_rate[]             = {44100, 48000};
+
+#define ARRAY_SIZE(a)   (sizeof(a) / sizeof((a)[0]))
+
+struct sweep_stat
+{
+    unsigned long xruns;
+    unsigned long wakeups;          // voluntary context switches, i.e. times we slept
+    unsigned long reads;            // times data was waiting when we woke up
+    snd_pcm_sframes_t avail_sum;
+    snd_pcm_sframes_t avail_max;
+    double wall;                    // in s
+    double cpu;                     // user + sys, in s
+};
+
+static double timeval_sec(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/**
+ * capture for `seconds`, reading whatever is available every time the device wakes us up
+ */
+static int sweep_run(snd_pcm_t *handle, unsigned int seconds, struct sweep_stat *stat)
+{
+    size_t frame_bytes = snd_pcm_format_physical_width(format) / 8 * channel;
+    const snd_pcm_channel_area_t* areas;
+    snd_pcm_uframes_t offset, frames;
+    snd_pcm_sframes_t avail;
+    struct timespec tp_start, tp_now;
+    struct rusage ru_start, ru_end;
+    char *buf = NULL;
+    int ret;
+
+    memset(stat, 0, sizeof(*stat));
+    if (access_type == SND_PCM_ACCESS_RW_INTERLEAVED && (buf = malloc(buffer_size * frame_bytes)) == NULL)
+        return -1;
+
+    getrusage(RUSAGE_THREAD, &ru_start);
+    clock_gettime(CLOCK_MONOTONIC, &tp_start);
+    snd_pcm_start(handle);
+
+    for (;;)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &tp_now);
+        stat->wall = tp_now.tv_sec - tp_start.tv_sec + (tp_now.tv_nsec - tp_start.tv_nsec) / 1e9;
+        if (stat->wall >= seconds || !signal_pause_switch)
+            break;
+
+        ret = snd_pcm_wait(handle, 1000);
+        avail = ret < 0 ? ret : snd_pcm_avail_update(handle);
+        if (avail < 0)
+        {
+            stat->xruns++;
+            if (xrun_recovery(handle, avail) < 0)
+                break;
+            snd_pcm_start(handle);
+            continue;
+        }
+        if (avail == 0)
+            continue;
+
+        stat->reads++;
+        stat->avail_sum += avail;
+        if (avail > stat->avail_max)
+            stat->avail_max = avail;
+
+        while (avail > 0)
+        {
+            if (buf)
+            {
+                ret = snd_pcm_readi(handle, buf, avail);
+            }
+            else
+            {
+                frames = avail;
+                ret = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+                if (ret >= 0)
+                    ret = snd_pcm_mmap_commit(handle, offset, frames);
+            }
+            if (ret <= 0)
+                break;
+            avail -= ret;
+        }
+    }
+
+    snd_pcm_drop(handle);
+    getrusage(RUSAGE_THREAD, &ru_end);
+    stat->wakeups = ru_end.ru_nvcsw - ru_start.ru_nvcsw;
+    stat->cpu = timeval_sec(&ru_end.ru_utime) - timeval_sec(&ru_start.ru_utime) +
+                timeval_sec(&ru_end.ru_stime) - timeval_sec(&ru_start.ru_stime);
+    free(buf);
+    return 0;
+}
+
+/**
+ * walk access x period_time x periods x rate, one CSV row per point
+ */
+static int sweep(const char *device_name, unsigned int seconds, FILE *csv)
+{
+    unsigned int a, t, p, r;
+    snd_pcm_t* handle;
+    struct sweep_stat stat;
+    const char *status;
+
+    /* record what the device makes of the request instead of refusing it */
+    strict_params = 0;
+    /* the CSV may be on stdout, keep the dumps out of it */
+    info_out = stderr;
+
+    fprintf(csv, "access,period_time,periods,rate,actual_rate,period_size,buffer_size,status,"
+                 "xruns,wakeups_per_s,cpu_pct,latency_avg_us,latency_max_us\n");
+    for (a = 0; a < ARRAY_SIZE(sweep_access); a++)
+    for (t = 0; t < ARRAY_SIZE(sweep_period_time); t++)
+    for (p = 0; p < ARRAY_SIZE(sweep_periods); p++)
+    for (r = 0; r < ARRAY_SIZE(sweep_rate); r++)
+    {
+        if (!signal_pause_switch)
+            return 0;
+
+        /* prepare_device() writes back what it got */
+        access_type = sweep_access[a];
+        period_time = sweep_period_time[t];
+        periods = sweep_periods[p];
+        rate = sweep_rate[r];
+        period_size = buffer_size = 0;
+        memset(&stat, 0, sizeof(stat));
+
+        if (prepare_device(device_name, &handle) != 0)
+            status = "unsupported";
+        else if (sweep_run(handle, seconds, &stat) < 0)
+            status = "failed";
+        else
+            status = "ok";
+        if (handle)
+            snd_pcm_close(handle);
+
+        fprintf(csv, "%s,%u,%u,%u,%u,%ld,%ld,%s,%lu,%.1f,%.2f,%.0f,%.0f\n",
+                snd_pcm_access_name(sweep_access[a]), sweep_period_time[t], sweep_periods[p], sweep_rate[r],
+                rate, (long)period_size, (long)buffer_size, status,
+                stat.xruns,
+                stat.wall > 0 ? stat.wakeups / stat.wall : 0.0,
+                stat.wall > 0 ? 100 * stat.cpu / stat.wall : 0.0,
+                stat.reads ? 1e6 * stat.avail_sum / stat.reads / rate : 0.0,
+                1e6 * stat.avail_max / rate);
+        fflush(csv);
+    }
+    return 0;
+}
+
+/****************************
+ * Capture Streams
+ ****************************/
+
+#define MAX_STREAMS     8
+
+/* suspend recovery: snd_pcm_resume() retried with backoff, snd_pcm_prepare() after the deadline */
+#define RESUME_DELAY_MIN_NS     1000000ULL          // 1ms
+#define RESUME_DELAY_MAX_NS     200000000ULL        // 200ms
+#define RESUME_DEADLINE_NS      3000000000ULL       // 3s
+
+struct capture_stream
+{
+    const char *device_name;
+    snd_pcm_t *handle;
+    int linked;                     // linked to streams[0], started/stopped with it
+    struct pollfd *pfds;            // slice of the shared poll set
+    int npfds;
+    snd_pcm_uframes_t period_size;
+    unsigned long frames;
+    unsigned long xruns;
+    char sink_path[PATH_MAX];
+    struct capture_sink sink;
+    int sink_open;                  // sink still to be closed, see close_sinks()
+    struct level_meter meter;
+    struct vad_gate gate;
+    int stamp_due;                  // next period written needs an index stamp
+
+    /* while suspended, the stream is left out of poll and only retried, see resume_stream() */
+    int resuming;
+    uint64_t resume_deadline_ns;
+    uint64_t resume_next_ns;
+    uint64_t resume_delay_ns;
+    uint32_t resume_event;          // telemetry event being recovered
+};
+
+static struct capture_stream streams[MAX_STREAMS];
+
+/**
+ * flush what is queued and finalize the WAV/RF64 header, also when main() exits on an error
+ */
+static int close_sinks(void)
+{
+    int i, err = 0;
+
+    for (i = 0; i < MAX_STREAMS; i++)
+    {
+        if (!streams[i].sink_open)
+            continue;
+        streams[i].sink_open = 0;
+        if (capture_sink_close(&streams[i].sink) < 0)
+            err = -1;
+    }
+    return err;
+}
+
+static void close_sinks_at_exit(void)
+{
+    close_sinks();
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * a suspended PCM keeps reporting POLLERR, poll() skips negative fds
+ */
+static void stream_poll_enable(struct capture_stream *stream, int enable)
+{
+    int i;
+
+    for (i = 0; i < stream->npfds; i++)
+    {
+        if (enable != (stream->pfds[i].fd >= 0))
+            stream->pfds[i].fd = ~stream->pfds[i].fd;
+    }
+}
+
+static void begin_resume(struct capture_stream *stream, uint32_t event)
+{
+    uint64_t now = monotonic_ns();
+
+    stream->resuming = 1;
+    stream->resume_event = event;
+    stream->resume_deadline_ns = now + RESUME_DEADLINE_NS;
+    stream->resume_next_ns = now;
+    stream->resume_delay_ns = RESUME_DELAY_MIN_NS;
+    stream_poll_enable(stream, 0);
+}
+
+static void end_resume(struct capture_stream *stream, int result)
+{
+    stream->resuming = 0;
+    xrun_telemetry_recovered(&telemetry, stream->resume_event, result);
+    stream_poll_enable(stream, 1);
+}
+
+/**
+ * one step of suspend recovery, never sleeps; called when resume_next_ns is due
+ */
+static int resume_stream(int idx, struct capture_stream *stream, uint64_t now)
+{
+    int err;
+
+    /* a linked stream may have been resumed along with its group */
+    if (snd_pcm_state(stream->handle) != SND_PCM_STATE_SUSPENDED)
+    {
+        LOG("Stream %ld: resumed by group", idx);
+        end_resume(stream, 0);
+        return 0;
+    }
+
+    err = snd_pcm_resume(stream->handle);
+    if (err == -EAGAIN && now < stream->resume_deadline_ns)
+    {
+        stream->resume_next_ns = now + stream->resume_delay_ns;
+        stream->resume_delay_ns *= 2;
+        if (stream->resume_delay_ns > RESUME_DELAY_MAX_NS)
+            stream->resume_delay_ns = RESUME_DELAY_MAX_NS;
+        return 0;
+    }
+    if (err == 0)
+    {
+        LOG("Stream %ld: state transition: SUSPENDED -> RUNNING (resumed)", idx);
+        end_resume(stream, 0);
+        return 0;
+    }
+
+    /* gave up waiting, or the driver can't resume: start over */
+    LOG("Stream %ld: resume failed (%ld), state transition: SUSPENDED -> PREPARED", idx, err);
+    err = snd_pcm_prepare(stream->handle);
+    if (err == 0)
+        err = snd_pcm_start(stream->handle);
+    if (err < 0 && err != -EBADFD)
+    {
+        end_resume(stream, err);
+        pr_error("Can't recover from suspended, prepare failed", err);
+        return -1;
+    }
+    end_resume(stream, 0);
+    return 0;
+}
+
+/**
+ * poll() timeout until the earliest resume retry, -1 if nothing is suspended
+ */
+static int resume_timeout_ms(int nstreams)
+{
+    uint64_t now = monotonic_ns(), next = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < nstreams; i++)
+    {
+        if (streams[i].resuming && streams[i].resume_next_ns < next)
+            next = streams[i].resume_next_ns;
+    }
+    if (next == UINT64_MAX)
+        return -1;
+    return next <= now ? 0 : (next - now + 999999) / 1000000;
+}
+
+/**
+ * `peer` is prepared and started along with `stream`: itself, or both in the linked group of streams[0]
+ */
+static int recovers_with(const struct capture_stream *stream, const struct capture_stream *peer)
+{
+    if (peer == stream)
+        return 1;
+    if (peer->handle == NULL || peer->resuming)
+        return 0;
+    return (stream->linked || stream == &streams[0]) && (peer->linked || peer == &streams[0]);
+}
+
+/**
+ * bring stream back to RUNNING, a linked group is prepared and started as a whole
+ */
+static int recover_stream(struct capture_stream *stream, int err)
+{
+    uint32_t event[MAX_STREAMS];
+    int i, result = 0;
+
+    if (err == -ESTRPIPE)
+    {
+        stream->xruns++;
+        if (gate_on)
+            vad_gate_reset(&stream->gate);
+        begin_resume(stream, xrun_telemetry_event(&telemetry, stream->handle, stream - streams, err));
+        return 0;
+    }
+
+    /* prepare and start below restart the whole group, account for every member */
+    for (i = 0; i < MAX_STREAMS; i++)
+    {
+        if (!recovers_with(stream, &streams[i]))
+            continue;
+        streams[i].xruns++;
+        if (gate_on)
+            vad_gate_reset(&streams[i].gate);
+        event[i] = xrun_telemetry_event(&telemetry, streams[i].handle, i, err);
+    }
+
+    if (xrun_recovery(stream->handle, err) < 0)
+        result = -1;
+    else
+    {
+        err = snd_pcm_start(stream->handle);
+        // -EBADFD: another stream of the group has started it already
+        if (err < 0 && err != -EBADFD)
+        {
+            result = err;
+            pr_error("snd_pcm_start failed", err);
+        }
+    }
 
-    /* 5. Free memory */
-    snd_pcm_hw_params_free(hw_params);
-    snd_pcm_sw_params_free(sw_params);
+    for (i = 0; i < MAX_STREAMS; i++)
+    {
+        if (recovers_with(stream, &streams[i]))
+            xrun_telemetry_recovered(&telemetry, event[i], result);
+    }
+    return result < 0 ? -1 : 0;
+}
+
+/**
+ * hand a period to the sink, through the gate if any, ts_ns is when its first frame was captured
+ */
+static void record_period(struct capture_stream *stream, const snd_pcm_channel_area_t *areas,
+                          snd_pcm_uframes_t offset, snd_pcm_uframes_t frames, int64_t ts_ns, int64_t audio_ns)
+{
+    const snd_pcm_channel_area_t *pre_areas;
+    snd_pcm_uframes_t pre_frames;
+    int64_t pre_ns, pre_audio_ns;
 
+    if (gate_on)
+    {
+        if (!vad_gate_feed(&stream->gate, areas, offset, frames, ts_ns, audio_ns))
+        {
+            // what follows the gap is stamped, that is the gap marker in the index
+            stream->stamp_due = 1;
+            return;
+        }
+        if (vad_gate_preroll(&stream->gate, &pre_areas, &pre_frames, &pre_ns, &pre_audio_ns))
+        {
+            // the pre-roll runs contiguous up to this period, one stamp covers both
+            capture_sink_stamp(&stream->sink, pre_ns, pre_audio_ns);
+            stream->stamp_due = 0;
+            do
+                capture_sink_write(&stream->sink, pre_areas, 0, pre_frames);
+            while (vad_gate_preroll(&stream->gate, &pre_areas, &pre_frames, &pre_ns, &pre_audio_ns));
+        }
+    }
+    if (stream->stamp_due)
+    {
+        capture_sink_stamp(&stream->sink, ts_ns, audio_ns);
+        stream->stamp_due = 0;
+    }
+    capture_sink_write(&stream->sink, areas, offset, frames);
+}
+
+/**
+ * take every full period the device has ready, with mmap transfers
+ */
+static int service_stream(int idx, struct capture_stream *stream)
+{
+    snd_pcm_t *handle = stream->handle;
+    snd_pcm_sframes_t cnt_avail_frame;
+    snd_pcm_status_t *status;
+    snd_htimestamp_t htstamp, audio_tstamp;
+    int64_t status_ns = 0, status_audio_ns = 0, period_ns;
+    snd_pcm_sframes_t ahead = 0;
+    const snd_pcm_channel_area_t* areas;
+    snd_pcm_uframes_t offset, frames;
+    unsigned int chn;
+    int ret;
+
+    // make sure we are always in RUNNING state
+    switch (snd_pcm_state(handle))
+    {
+        case (SND_PCM_STATE_PREPARED):
+            LOG("Stream %ld: state transition: PREPARED -> RUNNING", idx);
+            ret = snd_pcm_start(handle);
+            if (ret < 0 && ret != -EBADFD)
+            {
+                pr_error("snd_pcm_start failed", ret);
+                return -1;
+            }
+            return 0;
+
+        case (SND_PCM_STATE_XRUN):
+            LOG("Stream %ld: state transition: XRUN -> PREPARED", idx);
+            return recover_stream(stream, -EPIPE);
+
+        case (SND_PCM_STATE_SUSPENDED):
+            LOG("Stream %ld: suspended, waiting for resume", idx);
+            return recover_stream(stream, -ESTRPIPE);
+
+        case (SND_PCM_STATE_RUNNING):
+            break;
+        default:
+            fflush(stdout);
+            fputs("Unknown entry state...\n", stderr);
+            return -1;
+    }
+
+    // when the hardware pointer was where, the periods below are timed back from it
+    if (output && index_output)
+    {
+        snd_pcm_status_alloca(&status);
+        ret = snd_pcm_status(handle, status);
+        if (ret < 0)
+            return recover_stream(stream, ret);
+        snd_pcm_status_get_htstamp(status, &htstamp);
+        snd_pcm_status_get_audio_htstamp(status, &audio_tstamp);
+        status_ns = (int64_t)htstamp.tv_sec * 1000000000 + htstamp.tv_nsec;
+        status_audio_ns = (int64_t)audio_tstamp.tv_sec * 1000000000 + audio_tstamp.tv_nsec;
+        ahead = snd_pcm_status_get_avail(status);
+        stream->stamp_due = 1;
+    }
+
+    // get available frame
+    cnt_avail_frame = snd_pcm_avail_update(handle);
+    if (cnt_avail_frame < 0)
+        return recover_stream(stream, cnt_avail_frame);
+#ifdef VERBOSE_LOG
+    LOG("Stream %ld: available frame in ring buffer: %ld", idx, cnt_avail_frame);
+#endif
+
+    while (cnt_avail_frame >= (snd_pcm_sframes_t)stream->period_size)
+    {
+        frames = stream->period_size;
+        ret = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);  // we want to read one period_size frames
+        if (ret < 0)
+            return recover_stream(stream, ret);
+
+        if (stream->period_size != frames)
+        {
+            LOG("!!! Stream %ld: actual available frames: %lu; expected: %lu", idx, frames, stream->period_size);
+        }
+#ifdef VERBOSE_LOG
+        dump_areainfo(areas);
+#endif
+        LOG("Stream %ld: offset: %lu(frame), frame: %lu(frame)", idx, offset, frames);
+
+        // meter and copy out before the frames are given back to the device
+        if (meter_hz && level_meter_feed(&stream->meter, areas, offset, frames))
+        {
+            for (chn = 0; chn < channel; chn++)
+            {
+                LOG("Stream %ld: level ch%ld: peak %ld, rms %ld (0.1 dBFS), clipped %ld", idx, chn,
+                    lrintf(10 * fmaxf(stream->meter.reading.peak_db[chn], -120)),
+                    lrintf(10 * fmaxf(stream->meter.reading.rms_db[chn], -120)),
+                    stream->meter.reading.clipped[chn]);
+            }
+        }
+        if (output)
+        {
+            period_ns = (int64_t)ahead * 1000000000 / rate;
+            // 0 is "the driver has no audio timestamp" in the index, keep it so
+            record_period(stream, areas, offset, frames, status_ns - period_ns,
+                          status_audio_ns ? status_audio_ns - period_ns : 0);
+        }
+
+        ret = snd_pcm_mmap_commit(handle, offset, frames);   // one period frames read
+        if (ret < 0 || ret != frames)
+            return recover_stream(stream, ret >= 0 ? -EPIPE : ret);
+        stream->frames += frames;
+        cnt_avail_frame -= frames;
+        ahead -= frames;
+    }
     return 0;
 }
 
-int main()
+static void usage(const char *prog)
+{
+    fprintf(stdout,
+            "Usage: %s [OPTION]...\n"
+            "-h,--help      help\n"
+            "-D,--device    capture device, repeat to capture from several at once\n"
+            "-o,--output    record raw frames into file, FILE.N for device N if several\n"
+            "-d,--direct    write file with O_DIRECT\n"
+            "-w,--wav       record WAV instead of raw frames, RF64 beyond 4GiB\n"
+            "-i,--index     index capture timestamps into FILE.idx, see ts_seek\n"
+            "-g,--gate      leave out periods below this level(dBFS, default -50), implies -i\n"
+            "-v,--vad       open the gate on voice only, implies -g\n"
+            "-S,--sweep     sweep period/buffer/rate/access, write CSV into file\n"
+            "-t,--time      seconds to capture per sweep point\n"
+            "-m,--meter     log peak/RMS/clip levels this many times per second\n"
+            "Send SIGUSR1 to stop capture.\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
 {
     const char* device_name = "hw:0,0";
     //const char* device_name = "sd_carplay_downlink_in";
-    int ret;
-    snd_pcm_t* handle;
+    int ret, err = 0;
     struct sigaction act;
+    const char *sweep_csv = NULL;
+    unsigned int sweep_time = 3;
+    FILE *csv;
+    struct capture_stream *stream;
+    int nstreams = 0, i;
+    struct pollfd *pfds, *pfd;
+    int npfds = 0;
+    unsigned short revents;
+    uint64_t now;
+    int loop = 0;
+
+    struct option long_option[] =
+    {
+        {"help", 0, NULL, 'h'},
+        {"device", 1, NULL, 'D'},
+        {"output", 1, NULL, 'o'},
+        {"direct", 0, NULL, 'd'},
+        {"wav", 0, NULL, 'w'},
+        {"index", 0, NULL, 'i'},
+        {"gate", 1, NULL, 'g'},
+        {"vad", 0, NULL, 'v'},
+        {"sweep", 1, NULL, 'S'},
+        {"time", 1, NULL, 't'},
+        {"meter", 1, NULL, 'm'},
+        {NULL, 0, NULL, 0},
+    };
+
+    while ((ret = getopt_long(argc, argv, "hD:o:dwig:vS:t:m:", long_option, NULL)) != -1)
+    {
+        switch (ret)
+        {
+            case 'D':
+                if (nstreams == MAX_STREAMS)
+                {
+                    fprintf(stderr, "at most %d devices\n", MAX_STREAMS);
+                    exit(1);
+                }
+                streams[nstreams++].device_name = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'd':
+                direct = 1;
+                break;
+            case 'w':
+                wav = 1;
+                break;
+            case 'i':
+                index_output = 1;
+                break;
+            case 'g':
+                gate_on = 1;
+                gate_db = atof(optarg);
+                break;
+            case 'v':
+                gate_on = 1;
+                gate_spectral = 1;
+                break;
+            case 'S':
+                sweep_csv = optarg;
+                break;
+            case 't':
+                sweep_time = atoi(optarg);
+                break;
+            case 'm':
+                meter_hz = atoi(optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (nstreams == 0)
+        streams[nstreams++].device_name = device_name;
+    // gaps left by the gate are only told by the index
+    if (gate_on)
+        index_output = 1;
 
     /* 0. install signal handler */
     act.sa_handler = toggle;
@@ -440,143 +1145,199 @@ int main()
         exit(1);
     }
 
-    /* prepare PCM device */
-    ret = prepare_device(device_name, &handle);
-    if (ret != 0)
+    /* sweep mode opens and closes the device for every point itself */
+    if (sweep_csv)
     {
-        fflush(stdout);
-        fprintf(stderr, "prepare_device failed!\n");
-        exit(1);
+        csv = strcmp(sweep_csv, "-") ? fopen(sweep_csv, "w") : stdout;
+        if (csv == NULL)
+        {
+            fflush(stdout);
+            fprintf(stderr, "open %s failed: %s\n", sweep_csv, strerror(errno));
+            exit(1);
+        }
+        sweep(streams[0].device_name, sweep_time, csv);
+        if (csv != stdout)
+            fclose(csv);
+        return 0;
     }
 
+    /* prepare every PCM device, all with the same parameters */
+    for (i = 0; i < nstreams; i++)
+    {
+        stream = &streams[i];
+        ret = prepare_device(stream->device_name, &stream->handle);
+        if (ret != 0)
+        {
+            fflush(stdout);
+            fprintf(stderr, "prepare_device %s failed!\n", stream->device_name);
+            exit(1);
+        }
+        stream->period_size = period_size;
+        stream->npfds = snd_pcm_poll_descriptors_count(stream->handle);
+        npfds += stream->npfds;
+    }
 
-    /* start capture */
-    //char buf[100000];
-    int loop = 0;
-    snd_pcm_sframes_t cnt_avail_frame;
-    const snd_pcm_channel_area_t* areas;
-    snd_pcm_state_t pcm_state;
-    snd_pcm_uframes_t offset, frames;
-    struct timespec tp_start, tp_end;
-
-    while (signal_pause_switch)
+    /* one poll set for all of them, every stream owns a slice of it */
+    pfds = calloc(npfds, sizeof(*pfds));
+    if (pfds == NULL)
     {
-#ifdef VERBOSE_LOG
-        fprintf(stdout, "********************\nLoop: %d\n", loop++);
-#endif
-        // make sure we are always in RUNNING state
-        pcm_state = snd_pcm_state(handle);
-        switch (pcm_state)
+        fflush(stdout);
+        fprintf(stderr, "no memory for poll descriptors\n");
+        exit(1);
+    }
+    for (i = 0, pfd = pfds; i < nstreams; pfd += streams[i].npfds, i++)
+    {
+        stream = &streams[i];
+        stream->pfds = pfd;
+        ret = snd_pcm_poll_descriptors(stream->handle, stream->pfds, stream->npfds);
+        if (ret < 0)
         {
-            case (SND_PCM_STATE_PREPARED):
-                fputs("State transition: PREPARED -> RUNNING\n", stdout);
-                ret = snd_pcm_start(handle);
-                //fprintf(stdout, "Current state: %s\n", snd_pcm_state_name(snd_pcm_state(handle)));
-                if (ret < 0)
-                {
-                    fflush(stdout);
-                    fputs("Failed!\n", stderr);
-                    exit(1);
-                }
-                else
-                    continue;
+            pr_error("snd_pcm_poll_descriptors failed", ret);
+            exit(1);
+        }
+    }
 
-            case (SND_PCM_STATE_XRUN):
-                fputs("State transition: XRUN -> PREPARED\n", stdout);
-                if (xrun_recovery(handle, -EPIPE) < 0)
-                    exit(1);
-                else 
-                    continue;
+    atexit(close_sinks_at_exit);
+    for (i = 0; i < nstreams; i++)
+    {
+        stream = &streams[i];
 
-            case (SND_PCM_STATE_SUSPENDED):
-                fputs("State transition: SUSPENDED -> PREPARED\n", stdout);
-                if (xrun_recovery(handle, -ESTRPIPE) < 0)
-                    exit(1);
-                else 
-                    continue;
-            case (SND_PCM_STATE_RUNNING):
-                break;
-            default:
+        /* open recording sink, its writer thread takes all the file IO */
+        if (output)
+        {
+            if (nstreams == 1)
+                snprintf(stream->sink_path, sizeof(stream->sink_path), "%s", output);
+            else
+                snprintf(stream->sink_path, sizeof(stream->sink_path), "%s.%d", output, i);
+            if (capture_sink_open(&stream->sink, stream->sink_path,
+                                  (direct ? SINK_DIRECT : 0) | (wav ? SINK_WAV : 0) |
+                                  (index_output ? SINK_INDEX : 0),
+                                  format, channel, rate, stream->period_size) < 0)
+            {
                 fflush(stdout);
-                fputs("Unknown entry state...\n", stderr);
+                fprintf(stderr, "capture_sink_open %s failed: %s\n", stream->sink_path, strerror(errno));
                 exit(1);
+            }
+            stream->sink_open = 1;
         }
 
-        // get available frame
-        cnt_avail_frame = snd_pcm_avail_update(handle);
-        if (cnt_avail_frame < 0)
+        if (output && gate_on &&
+            vad_gate_init(&stream->gate, format, channel, rate, stream->period_size, gate_db, gate_spectral) < 0)
         {
-            if (xrun_recovery(handle, cnt_avail_frame) < 0)
-                exit(1);
-            else
-                continue;
+            fflush(stdout);
+            fprintf(stderr, "gate does not support %s x %u channels\n", snd_pcm_format_name(format), channel);
+            exit(1);
         }
-        else
+
+        if (meter_hz && level_meter_init(&stream->meter, format, channel, rate, meter_hz) < 0)
         {
-#ifdef VERBOSE_LOG
-            fprintf(stdout, "Available frame in ring buffer: %d\n", (int)cnt_avail_frame);
-#endif
-            if (cnt_avail_frame < period_size)
+            fflush(stdout);
+            fprintf(stderr, "level meter does not support %s x %u channels\n", snd_pcm_format_name(format), channel);
+            exit(1);
+        }
+
+        /* linked streams start, stop and prepare together */
+        if (i > 0)
+        {
+            ret = snd_pcm_link(streams[0].handle, stream->handle);
+            if (ret < 0)
             {
                 fflush(stdout);
-                fputs("Not enough available data, waiting...\n", stderr);
-                // wait for PCM to be ready(i.e. available frame >= avail_min (which equals to "period_size" by default))
-#ifdef VERBOSE_LOG
-                clock_gettime(CLOCK_REALTIME, &tp_start);
-#endif
-                ret = snd_pcm_wait(handle, -1);
-                if (ret < 0)
-                {
-                    if (xrun_recovery(handle, ret) < 0)
-                        exit(1);
-                    else 
-                        continue;
-                }
-#ifdef VERBOSE_LOG
-                // get available frame
-                cnt_avail_frame = snd_pcm_avail_update(handle);
-                clock_gettime(CLOCK_REALTIME, &tp_end);
-                fprintf(stdout, "Enough data is in buffer: %lu (duration: %ld ms)\n",
-                        cnt_avail_frame,
-                        1000*(tp_end.tv_sec-tp_start.tv_sec)+(tp_end.tv_nsec-tp_start.tv_nsec)/1000000);
-#endif
+                fprintf(stderr, "WARN: can't link %s to %s (%s), starting it on its own\n",
+                        stream->device_name, streams[0].device_name, snd_strerror(ret));
             }
+            else
+                stream->linked = 1;
         }
+    }
 
-        frames = period_size;
-        ret = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);  // we want to read one period_size frames
-        //ret = snd_pcm_readi(handle, buf, frames);
+    /* from here on nothing in the capture loop writes to stdout itself */
+    if (rt_log_start(&cap_log, 4096, stdout) < 0)
+    {
+        fflush(stdout);
+        fprintf(stderr, "rt_log_start failed!\n");
+        exit(1);
+    }
+    atexit(stop_log);
+
+    if (xrun_telemetry_open(&telemetry, argv[0]) < 0)
+    {
+        fflush(stdout);
+        fprintf(stderr, "WARN: no xrun telemetry: %s\n", strerror(errno));
+    }
+    atexit(close_telemetry);
+
+    /* start capture, linked ones go with the first */
+    for (i = 0; i < nstreams; i++)
+    {
+        if (streams[i].linked)
+            continue;
+        ret = snd_pcm_start(streams[i].handle);
         if (ret < 0)
         {
-            if (xrun_recovery(handle, ret) < 0)
-                exit(1);
-            else
-                continue;
+            pr_error("snd_pcm_start failed", ret);
+            exit(1);
         }
-        else
+    }
+
+    while (signal_pause_switch)
+    {
+#ifdef VERBOSE_LOG
+        LOG("Loop: %ld", loop++);
+#endif
+        ret = poll(pfds, npfds, resume_timeout_ms(nstreams));
+        if (ret < 0)
         {
-            if (period_size != frames)
-            {
-                fflush(stdout);
-                fprintf(stderr, "!!! Actual available frames: %lu; expected: %lu\n", frames, period_size);
-            }
-            dump_areainfo(areas);
-            fprintf(stdout, "Offset: %lu(frame)\n", (unsigned long)offset);
-            fprintf(stdout, "Frame: %lu(frame)\n", (unsigned long)frames);
+            if (errno == EINTR)
+                continue;
+            fflush(stdout);
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            exit(1);
+        }
 
-            ret = snd_pcm_mmap_commit(handle, offset, frames);   // one period frames read
-            if (ret < 0 || ret != frames)
+        now = monotonic_ns();
+        for (i = 0; i < nstreams; i++)
+        {
+            stream = &streams[i];
+            if (stream->resuming)
             {
-                if (xrun_recovery(handle, ret >= 0 ? -EPIPE : ret) < 0)
+                if (now >= stream->resume_next_ns && resume_stream(i, stream, now) < 0)
                     exit(1);
-                else
-                    continue;
+                continue;
             }
+            snd_pcm_poll_descriptors_revents(stream->handle, stream->pfds, stream->npfds, &revents);
+            if (revents == 0)
+                continue;
+            if (service_stream(i, stream) < 0)
+                exit(1);
         }
 
-        /* Sleep so that we can get less log and get over-run */
+#ifdef FORCE_OVERRUN
         usleep(11000); // 11ms
+#endif
+    }
+
+    for (i = 0; i < nstreams; i++)
+        snd_pcm_close(streams[i].handle);
+    rt_log_stop(&cap_log);
+    if (close_sinks() < 0)
+        err = 1;
 
-        fprintf(stdout, "********************\n");
+    for (i = 0; i < nstreams; i++)
+    {
+        stream = &streams[i];
+        fprintf(stdout, "Stream %d (%s): %lu frames, %lu xruns\n",
+                i, stream->device_name, stream->frames, stream->xruns);
+        if (output)
+        {
+            capture_sink_report(&stream->sink, stdout);
+            if (gate_on)
+            {
+                vad_gate_report(&stream->gate, stdout);
+                vad_gate_free(&stream->gate);
+            }
+        }
     }
+    free(pfds);
+    return err;
 }
@@ -0,0 +1,83 @@
+/*************************************************************************
+ File Name: rt_log.c
+ Description: Logging from a real-time loop without touching stdio
+ ************************************************************************/
+
+#include <errno.h>
+#include "rt_log.h"
+
+/* format everything queued so far, returns records written */
+static unsigned int rt_log_drain(struct rt_log *log)
+{
+    struct rt_log_rec *rec;
+    unsigned int n = 0;
+    long ns;
+
+    while ((rec = spsc_ring_read_slot(&log->ring)) != NULL)
+    {
+        ns = (rec->ts.tv_sec - log->ts_start.tv_sec) * 1000000000L + (rec->ts.tv_nsec - log->ts_start.tv_nsec);
+        fprintf(log->out, "[%5ld.%06ld] ", ns / 1000000000L, ns % 1000000000L / 1000);
+        fprintf(log->out, rec->fmt,
+                rec->args[0], rec->args[1], rec->args[2],
+                rec->args[3], rec->args[4], rec->args[5]);
+        fputc('\n', log->out);
+        spsc_ring_read_release(&log->ring);
+        n++;
+    }
+    if (n > 0)
+        fflush(log->out);
+    return n;
+}
+
+static void *rt_log_thread(void *arg)
+{
+    struct rt_log *log = arg;
+    struct timespec period = {0, RT_LOG_FLUSH_MS * 1000000L};
+
+    while (!atomic_load(&log->stop))
+    {
+        rt_log_drain(log);
+        nanosleep(&period, NULL);
+    }
+    rt_log_drain(log);
+    return NULL;
+}
+
+int rt_log_start(struct rt_log *log, unsigned int nrecs, FILE *out)
+{
+    int err;
+
+    memset(log, 0, sizeof(*log));
+    if (spsc_ring_init(&log->ring, nrecs, sizeof(struct rt_log_rec)) < 0)
+        return -1;
+    log->out = out;
+    atomic_init(&log->dropped, 0);
+    atomic_init(&log->stop, 0);
+    clock_gettime(CLOCK_MONOTONIC, &log->ts_start);
+
+    err = pthread_create(&log->thread, NULL, rt_log_thread, log);
+    if (err != 0)
+    {
+        spsc_ring_free(&log->ring);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void rt_log_stop(struct rt_log *log)
+{
+    unsigned long dropped;
+
+    if (log->ring.slots == NULL)
+        return;
+    atomic_store(&log->stop, 1);
+    pthread_join(log->thread, NULL);
+
+    dropped = atomic_load(&log->dropped);
+    if (dropped > 0)
+        fprintf(log->out, "rt_log: %lu records dropped, ring of %u too small\n",
+                dropped, spsc_ring_size(&log->ring));
+    fflush(log->out);
+    spsc_ring_free(&log->ring);
+}
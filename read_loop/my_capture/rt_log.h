@@ -0,0 +1,77 @@
+/*************************************************************************
+ File Name: rt_log.h
+ Description: Logging from a real-time loop without touching stdio
+ ************************************************************************/
+
+#ifndef RT_LOG_H
+#define RT_LOG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "spsc_ring.h"
+
+#define RT_LOG_ARGS         6       // max arguments of one record
+#define RT_LOG_FLUSH_MS     20      // how often the log thread drains the ring
+
+/*
+ * The hot path only stores a timestamp, the format pointer and the
+ * arguments in a ring slot. Formatting and stdio happen later on the
+ * log thread. So:
+ *  - format must be a string literal (only its address is kept)
+ *  - every argument is stored as long, use %ld/%lu/%lx for all of them
+ *  - a trailing newline is added by the log thread
+ *  - only one thread may log into one struct rt_log
+ * If the ring is full the record is dropped and counted.
+ */
+struct rt_log_rec
+{
+    struct timespec ts;
+    const char *fmt;
+    long args[RT_LOG_ARGS];
+};
+
+struct rt_log
+{
+    struct spsc_ring ring;
+    FILE *out;
+    struct timespec ts_start;
+    atomic_ulong dropped;
+    atomic_int stop;
+    pthread_t thread;
+};
+
+/*
+ * @brief           Allocate ring and start log thread
+ * @in nrecs        Ring size in records, rounded up to a power of 2
+ * @in out          Where records are formatted to
+ * @return          0 on success, -1 on failure
+ */
+int rt_log_start(struct rt_log *log, unsigned int nrecs, FILE *out);
+
+/*
+ * @brief           Flush what is left, stop log thread and free ring
+ */
+void rt_log_stop(struct rt_log *log);
+
+static inline void rt_log_put(struct rt_log *log, const char *fmt, const long *args)
+{
+    struct rt_log_rec *rec = spsc_ring_write_slot(&log->ring);
+
+    if (rec == NULL)
+    {
+        atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &rec->ts);
+    rec->fmt = fmt;
+    memcpy(rec->args, args, sizeof(rec->args));
+    spsc_ring_write_commit(&log->ring);
+}
+
+/* RT_LOG(log, "avail %ld", avail); arguments are converted to long, missing ones are 0 */
+#define RT_LOG(log, fmt, ...) \
+    rt_log_put((log), (fmt), (const long[RT_LOG_ARGS + 1]){ 0, ##__VA_ARGS__ } + 1)
+
+#endif
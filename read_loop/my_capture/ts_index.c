@@ -0,0 +1,174 @@
+/*************************************************************************
+ File Name: ts_index.c
+ Description: Sidecar index of capture timestamps against frame positions
+ ************************************************************************/
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ts_index.h"
+
+static int64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t ts_index_realtime_offset(void)
+{
+    int64_t mono1, real, mono2;
+
+    /* realtime read between two monotonic reads, taken as their middle */
+    mono1 = clock_ns(CLOCK_MONOTONIC);
+    real = clock_ns(CLOCK_REALTIME);
+    mono2 = clock_ns(CLOCK_MONOTONIC);
+    return real - (mono1 + (mono2 - mono1) / 2);
+}
+
+FILE *ts_index_create(const char *path, unsigned int rate, unsigned int frame_bytes, uint64_t data_offset)
+{
+    struct ts_index_hdr hdr;
+    FILE *fp;
+
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+        return NULL;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TS_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.rate = rate;
+    hdr.frame_bytes = frame_bytes;
+    hdr.data_offset = data_offset;
+    hdr.realtime_offset_ns = ts_index_realtime_offset();
+    hdr.rec_size = sizeof(struct ts_index_rec);
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+int ts_index_open(struct ts_index *idx, const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(idx, 0, sizeof(*idx));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct ts_index_hdr))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    idx->hdr = map;
+    idx->map_size = st.st_size;
+    if (memcmp(idx->hdr->magic, TS_INDEX_MAGIC, sizeof(idx->hdr->magic)) != 0 ||
+        idx->hdr->rec_size != sizeof(struct ts_index_rec) || idx->hdr->rate == 0)
+    {
+        ts_index_close(idx);
+        errno = EINVAL;
+        return -1;
+    }
+    idx->recs = (const struct ts_index_rec *)(idx->hdr + 1);
+    /* a record cut short by a crash is ignored */
+    idx->nrecs = (idx->map_size - sizeof(struct ts_index_hdr)) / sizeof(struct ts_index_rec);
+    return 0;
+}
+
+void ts_index_close(struct ts_index *idx)
+{
+    if (idx->hdr)
+        munmap((void *)idx->hdr, idx->map_size);
+    memset(idx, 0, sizeof(*idx));
+}
+
+int64_t ts_index_frame_at(const struct ts_index *idx, int64_t mono_ns)
+{
+    const struct ts_index_rec *rec;
+    size_t lo = 0, hi = idx->nrecs, mid;
+    int64_t frame;
+
+    if (idx->nrecs == 0)
+        return -1;
+
+    /* last record not after mono_ns, or the first one */
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (idx->recs[mid].htstamp_ns <= mono_ns)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    rec = &idx->recs[lo];
+
+    /*
+     * Records are one period apart, so the nominal rate from the record
+     * before is as good as interpolating, and unlike interpolating it
+     * does not smear a gap over the frames before it.
+     */
+    frame = (int64_t)rec->frame_pos + (int64_t)((double)(mono_ns - rec->htstamp_ns) * idx->hdr->rate / 1e9);
+    if (lo + 1 < idx->nrecs && frame > (int64_t)idx->recs[lo + 1].frame_pos)
+        frame = idx->recs[lo + 1].frame_pos;
+    return frame < 0 ? 0 : frame;
+}
+
+int64_t ts_index_frame_at_realtime(const struct ts_index *idx, int64_t real_ns)
+{
+    size_t lo = 0, hi = idx->nrecs, mid;
+
+    if (idx->nrecs == 0)
+        return -1;
+
+    /* the offset drifts slowly, the one of the record before is close enough */
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (ts_index_realtime_of(&idx->recs[mid]) <= real_ns)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return ts_index_frame_at(idx, real_ns - idx->recs[lo].realtime_offset_ns);
+}
+
+int64_t ts_index_time_of(const struct ts_index *idx, uint64_t frame_pos)
+{
+    const struct ts_index_rec *rec;
+    size_t lo = 0, hi = idx->nrecs, mid;
+
+    if (idx->nrecs == 0)
+        return -1;
+
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (idx->recs[mid].frame_pos <= frame_pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    rec = &idx->recs[lo];
+    return rec->htstamp_ns + (int64_t)(((double)frame_pos - rec->frame_pos) * 1e9 / idx->hdr->rate);
+}
@@ -0,0 +1,106 @@
+/*************************************************************************
+ File Name: ts_index.h
+ Description: Sidecar index of capture timestamps against frame positions
+ ************************************************************************/
+
+#ifndef TS_INDEX_H
+#define TS_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TS_INDEX_MAGIC      "ALSATSI2"
+#define TS_INDEX_SUFFIX     ".idx"
+
+/*
+ * An index file is a struct ts_index_hdr followed by struct ts_index_rec,
+ * one per capture wakeup and one after every gap, in capture order, host
+ * byte order. Each record says which frame of the recording was captured
+ * at `htstamp_ns`: the first frame of a period, timed from the
+ * snd_pcm_status() of its wakeup. Between two records time runs linear
+ * with frames; a jump (xrun, suspend, dropped frames, gated silence)
+ * shows up as time advancing more than the frames do.
+ *
+ * CLOCK_REALTIME is slewed by NTP against CLOCK_MONOTONIC, by up to
+ * 500 ppm, so one offset taken at the start would be seconds off after
+ * hours. Every record carries the offset sampled when it was written
+ * out, realtime lookups use the one of the record nearest in time.
+ */
+struct ts_index_hdr
+{
+    char magic[8];                  // TS_INDEX_MAGIC, no NUL
+    uint32_t rate;                  // nominal
+    uint32_t frame_bytes;
+    uint64_t data_offset;           // where frame 0 is in the recording, in byte
+    int64_t realtime_offset_ns;     // CLOCK_REALTIME - CLOCK_MONOTONIC when the index was created
+    uint32_t rec_size;              // sizeof(struct ts_index_rec)
+    uint32_t reserved;
+};
+
+struct ts_index_rec
+{
+    uint64_t frame_pos;             // frame in the recording
+    int64_t htstamp_ns;             // system time, CLOCK_MONOTONIC
+    int64_t audio_tstamp_ns;        // time by the audio clock, 0 if the driver has none
+    int64_t realtime_offset_ns;     // CLOCK_REALTIME - CLOCK_MONOTONIC when the record was written
+};
+
+/*
+ * @brief           CLOCK_REALTIME - CLOCK_MONOTONIC now, for realtime_offset_ns
+ */
+int64_t ts_index_realtime_offset(void);
+
+/*
+ * @brief           Create index file and write its header
+ * @in path         Index file, truncated
+ * @return          Opened file, NULL with errno set on failure
+ */
+FILE *ts_index_create(const char *path, unsigned int rate, unsigned int frame_bytes, uint64_t data_offset);
+
+/*
+ * Read side, the file is mapped so seeking touches only the pages the
+ * binary search visits.
+ */
+struct ts_index
+{
+    const struct ts_index_hdr *hdr;
+    const struct ts_index_rec *recs;
+    size_t nrecs;
+    size_t map_size;
+};
+
+/*
+ * @brief           Map index file for seeking
+ * @return          0 on success, -1 with errno set on failure (EINVAL: not an index file)
+ */
+int ts_index_open(struct ts_index *idx, const char *path);
+void ts_index_close(struct ts_index *idx);
+
+/*
+ * @brief           Frame captured at a CLOCK_MONOTONIC time, O(log n) in records
+ * @in mono_ns      Time to look up, times outside the index are extrapolated
+ *                  from the first/last record at nominal rate
+ * @return          Frame position in the recording, clamped to 0; -1 if the index is empty
+ */
+int64_t ts_index_frame_at(const struct ts_index *idx, int64_t mono_ns);
+
+/*
+ * @brief           Same as ts_index_frame_at() for a CLOCK_REALTIME time,
+ *                  converted with the offset of the record nearest to it
+ */
+int64_t ts_index_frame_at_realtime(const struct ts_index *idx, int64_t real_ns);
+
+/*
+ * @brief           CLOCK_MONOTONIC time a frame was captured, inverse of ts_index_frame_at()
+ */
+int64_t ts_index_time_of(const struct ts_index *idx, uint64_t frame_pos);
+
+/*
+ * @brief           CLOCK_REALTIME time of a record
+ */
+static inline int64_t ts_index_realtime_of(const struct ts_index_rec *rec)
+{
+    return rec->htstamp_ns + rec->realtime_offset_ns;
+}
+
+#endif
@@ -0,0 +1,159 @@
+/*************************************************************************
+ File Name: ts_seek.c
+ Description: Look up a my_capture recording by time through its index
+
+ Usage: ts_seek FILE.idx [TIME...]
+   TIME is one of
+     @SECONDS                 wall clock, seconds since the epoch
+     +SECONDS                 since the first indexed frame
+     YYYY-MM-DD HH:MM:SS      wall clock, local time, fraction allowed
+   For every TIME the frame and the byte offset into the recording are
+   printed. Without TIME the index is summarized: span, measured rate
+   and the gaps (xrun, suspend, dropped frames) in it.
+ ************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "ts_index.h"
+
+#define GAP_MS          10      // time ahead of frames by this much between two records is a gap
+
+/* "2026-10-21 16:52:38.250" */
+static void format_realtime(int64_t real_ns, char *buf, size_t size)
+{
+    time_t sec = real_ns / 1000000000;
+    struct tm tm;
+    size_t n;
+
+    localtime_r(&sec, &tm);
+    n = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buf + n, size - n, ".%03d", (int)(real_ns % 1000000000 / 1000000));
+}
+
+/* TIME argument to CLOCK_REALTIME, -1 if not parsed */
+static int parse_time(const struct ts_index *idx, const char *arg, int64_t *real_ns)
+{
+    struct tm tm;
+    const char *end;
+    char *frac_end;
+    double frac = 0;
+
+    if (arg[0] == '@')
+    {
+        *real_ns = (int64_t)(strtod(arg + 1, &frac_end) * 1e9);
+        return *frac_end ? -1 : 0;
+    }
+    if (arg[0] == '+')
+    {
+        *real_ns = ts_index_realtime_of(&idx->recs[0]) +
+                   (int64_t)(strtod(arg + 1, &frac_end) * 1e9);
+        return *frac_end ? -1 : 0;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(arg, "%Y-%m-%d %H:%M:%S", &tm);
+    if (end == NULL)
+        return -1;
+    if (*end == '.')
+    {
+        frac = strtod(end, &frac_end);
+        end = frac_end;
+    }
+    if (*end)
+        return -1;
+    tm.tm_isdst = -1;
+    *real_ns = (int64_t)mktime(&tm) * 1000000000 + (int64_t)(frac * 1e9);
+    return 0;
+}
+
+static void summarize(const struct ts_index *idx)
+{
+    const struct ts_index_rec *first = &idx->recs[0], *last = &idx->recs[idx->nrecs - 1];
+    const struct ts_index_rec *prev, *rec;
+    double span = (last->htstamp_ns - first->htstamp_ns) / 1e9;
+    double audio_span = (last->audio_tstamp_ns - first->audio_tstamp_ns) / 1e9;
+    int64_t ahead;
+    unsigned long gaps = 0;
+    double gap_total = 0;
+    char buf[64];
+    size_t i;
+
+    format_realtime(ts_index_realtime_of(first), buf, sizeof(buf));
+    printf("records %zu, frames %llu-%llu, from %s", idx->nrecs,
+           (unsigned long long)first->frame_pos, (unsigned long long)last->frame_pos, buf);
+    format_realtime(ts_index_realtime_of(last), buf, sizeof(buf));
+    printf(" to %s (%.3f s)\n", buf, span);
+
+    for (i = 1; i < idx->nrecs; i++)
+    {
+        prev = &idx->recs[i - 1];
+        rec = &idx->recs[i];
+        ahead = (rec->htstamp_ns - prev->htstamp_ns) -
+                (int64_t)((double)(rec->frame_pos - prev->frame_pos) * 1e9 / idx->hdr->rate);
+        if (ahead < GAP_MS * 1000000LL)
+            continue;
+        gaps++;
+        gap_total += ahead / 1e9;
+        format_realtime(ts_index_realtime_of(rec), buf, sizeof(buf));
+        printf("gap at frame %llu, %s: %.3f ms missing\n",
+               (unsigned long long)rec->frame_pos, buf, ahead / 1e6);
+    }
+
+    /* only the stretch without gaps says how fast the device really runs */
+    if (span - gap_total > 0)
+        printf("rate %u nominal, %.3f measured", idx->hdr->rate,
+               (last->frame_pos - first->frame_pos) / (span - gap_total));
+    /* audio_tstamp_ns is 0 throughout when the driver has no audio timestamp */
+    if (gaps == 0 && span > 0 && audio_span > 0 && first->audio_tstamp_ns && last->audio_tstamp_ns)
+        printf(", audio clock %+.1f ppm against system clock", (audio_span - span) / span * 1e6);
+    printf("\n%lu gaps, %.3f s in total\n", gaps, gap_total);
+}
+
+int main(int argc, char *argv[])
+{
+    struct ts_index idx;
+    int64_t real_ns, frame;
+    char buf[64];
+    int i, err = 0;
+
+    if (argc < 2 || strcmp(argv[1], "-h") == 0)
+    {
+        fprintf(stderr, "Usage: %s FILE.idx [@SECONDS | +SECONDS | \"YYYY-MM-DD HH:MM:SS\"]...\n", argv[0]);
+        exit(argc < 2 ? 1 : 0);
+    }
+    if (ts_index_open(&idx, argv[1]) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        exit(1);
+    }
+    if (idx.nrecs == 0)
+    {
+        fprintf(stderr, "%s: no records\n", argv[1]);
+        ts_index_close(&idx);
+        exit(1);
+    }
+
+    if (argc == 2)
+        summarize(&idx);
+    for (i = 2; i < argc; i++)
+    {
+        if (parse_time(&idx, argv[i], &real_ns) < 0)
+        {
+            fprintf(stderr, "%s: bad time\n", argv[i]);
+            err = 1;
+            continue;
+        }
+        frame = ts_index_frame_at_realtime(&idx, real_ns);
+        format_realtime(real_ns, buf, sizeof(buf));
+        printf("%s: frame %lld, byte %llu\n", buf, (long long)frame,
+               (unsigned long long)(idx.hdr->data_offset + frame * idx.hdr->frame_bytes));
+    }
+
+    ts_index_close(&idx);
+    return err;
+}
@@ -0,0 +1,272 @@
+/*************************************************************************
+ File Name: vad_gate.c
+ Description: Drop silent periods before they are written to disk
+ ************************************************************************/
+
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include "vad_gate.h"
+
+/* RBJ cookbook, Q = 1/sqrt(2) */
+static void biquad_init(struct vad_biquad *bq, unsigned int rate, float freq, int highpass)
+{
+    double w0 = 2 * M_PI * freq / rate;
+    double cosw = cos(w0), alpha = sin(w0) / sqrt(2);
+    double a0 = 1 + alpha;
+
+    memset(bq, 0, sizeof(*bq));
+    bq->b0 = (highpass ? (1 + cosw) : (1 - cosw)) / 2 / a0;
+    bq->b1 = (highpass ? -(1 + cosw) : (1 - cosw)) / a0;
+    bq->b2 = bq->b0;
+    bq->a1 = -2 * cosw / a0;
+    bq->a2 = (1 - alpha) / a0;
+}
+
+static void biquad_reset(struct vad_biquad *bq)
+{
+    bq->x1 = bq->x2 = bq->y1 = bq->y2 = 0;
+}
+
+static inline float biquad_run(struct vad_biquad *bq, float x)
+{
+    float y = bq->b0 * x + bq->b1 * bq->x1 + bq->b2 * bq->x2 - bq->a1 * bq->y1 - bq->a2 * bq->y2;
+
+    bq->x2 = bq->x1;
+    bq->x1 = x;
+    bq->y2 = bq->y1;
+    bq->y1 = y;
+    return y;
+}
+
+int vad_gate_init(struct vad_gate *gate, snd_pcm_format_t format, unsigned int channels,
+                  unsigned int rate, snd_pcm_uframes_t max_frames, float threshold_db, int spectral)
+{
+    unsigned long preroll_frames = (unsigned long)rate * VAD_PREROLL_MS / 1000;
+
+    if ((format != SND_PCM_FORMAT_S16 && format != SND_PCM_FORMAT_S32) ||
+        channels == 0 || channels > VAD_MAX_CHANNELS || max_frames == 0)
+        return -1;
+
+    memset(gate, 0, sizeof(*gate));
+    gate->format = format;
+    gate->channels = channels;
+    gate->rate = rate;
+    gate->frame_bytes = channels * snd_pcm_format_physical_width(format) / 8;
+    gate->threshold = pow(10, threshold_db / 10);
+    gate->spectral = spectral;
+    gate->hangover_frames = (unsigned long)rate * VAD_HANGOVER_MS / 1000;
+
+    gate->slot_frames = max_frames;
+    gate->nslots = (preroll_frames + max_frames - 1) / max_frames;
+    if (gate->nslots > VAD_PREROLL_SLOTS)
+        gate->nslots = VAD_PREROLL_SLOTS;
+    gate->preroll = malloc(gate->nslots * max_frames * gate->frame_bytes);
+    if (gate->preroll == NULL)
+        return -1;
+
+    if (spectral)
+    {
+        gate->mix = malloc(max_frames * sizeof(float));
+        if (gate->mix == NULL)
+        {
+            vad_gate_free(gate);
+            return -1;
+        }
+        biquad_init(&gate->hpf, rate, VAD_BAND_LOW, 1);
+        biquad_init(&gate->lpf, rate, fminf(VAD_BAND_HIGH, rate * 0.45f), 0);
+    }
+    return 0;
+}
+
+void vad_gate_free(struct vad_gate *gate)
+{
+    free(gate->preroll);
+    free(gate->mix);
+    gate->preroll = NULL;
+    gate->mix = NULL;
+}
+
+/*
+ * Sum of squares of all samples normalized to full scale, and the mono
+ * mix for the spectral detector. One contiguous loop per channel, the
+ * stride is 1 for non-interleaved areas.
+ */
+#define DEFINE_ENERGY(name, type, full)                                                 \
+static double name(struct vad_gate *gate, const snd_pcm_channel_area_t *areas,          \
+                   snd_pcm_uframes_t offset, snd_pcm_uframes_t frames)                  \
+{                                                                                       \
+    const float scale = 1.0f / (full);                                                  \
+    const float mix_scale = scale / gate->channels;                                     \
+    const type *p;                                                                      \
+    snd_pcm_uframes_t i;                                                                \
+    unsigned int chn, stride;                                                           \
+    double sumsq = 0;                                                                   \
+    float acc, v;                                                                       \
+                                                                                        \
+    if (gate->mix)                                                                      \
+        memset(gate->mix, 0, frames * sizeof(float));                                   \
+    for (chn = 0; chn < gate->channels; chn++)                                          \
+    {                                                                                   \
+        p = (const type *)((const unsigned char *)areas[chn].addr +                     \
+                           (areas[chn].first + offset * areas[chn].step) / 8);          \
+        stride = areas[chn].step / (8 * sizeof(type));                                  \
+        acc = 0;                                                                        \
+        for (i = 0; i < frames; i++)                                                    \
+        {                                                                               \
+            v = p[i * stride] * scale;                                                  \
+            acc += v * v;                                                               \
+        }                                                                               \
+        sumsq += acc;                                                                   \
+        if (gate->mix)                                                                  \
+        {                                                                               \
+            for (i = 0; i < frames; i++)                                                \
+                gate->mix[i] += p[i * stride] * mix_scale;                              \
+        }                                                                               \
+    }                                                                                   \
+    return sumsq;                                                                       \
+}
+
+DEFINE_ENERGY(energy_s16, int16_t, 32768.0f)
+DEFINE_ENERGY(energy_s32, int32_t, 2147483648.0f)
+
+/* share of the mono mix energy inside the voice band */
+static float voice_ratio(struct vad_gate *gate, snd_pcm_uframes_t frames)
+{
+    float total = 0, band = 0, y;
+    snd_pcm_uframes_t i;
+
+    for (i = 0; i < frames; i++)
+    {
+        y = biquad_run(&gate->lpf, biquad_run(&gate->hpf, gate->mix[i]));
+        total += gate->mix[i] * gate->mix[i];
+        band += y * y;
+    }
+    return total > 0 ? band / total : 0;
+}
+
+static void preroll_store(struct vad_gate *gate, const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset,
+                          snd_pcm_uframes_t frames, int64_t ts_ns, int64_t audio_ns)
+{
+    unsigned int sample_bytes = gate->frame_bytes / gate->channels;
+    unsigned char *slot = gate->preroll + (size_t)gate->head * gate->slot_frames * gate->frame_bytes;
+    unsigned char *dst;
+    const unsigned char *src;
+    snd_pcm_uframes_t i;
+    unsigned int chn;
+
+    if (gate->nslots == 0)
+        return;
+    for (chn = 0; chn < gate->channels; chn++)
+    {
+        dst = slot + chn * sample_bytes;
+        for (i = 0; i < frames; i++)
+        {
+            src = (const unsigned char *)areas[chn].addr + (areas[chn].first + (offset + i) * areas[chn].step) / 8;
+            memcpy(dst, src, sample_bytes);
+            dst += gate->frame_bytes;
+        }
+    }
+    gate->frames[gate->head] = frames;
+    gate->ts_ns[gate->head] = ts_ns;
+    gate->audio_ns[gate->head] = audio_ns;
+    gate->head = (gate->head + 1) % gate->nslots;
+    if (gate->count < gate->nslots)
+        gate->count++;
+}
+
+int vad_gate_feed(struct vad_gate *gate, const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset,
+                  snd_pcm_uframes_t frames, int64_t ts_ns, int64_t audio_ns)
+{
+    unsigned long bytes = frames * gate->frame_bytes;
+    int active, keep;
+    double sumsq;
+
+    gate->captured += bytes;
+    if (frames == 0)
+        return gate->open;
+
+    sumsq = gate->format == SND_PCM_FORMAT_S16 ? energy_s16(gate, areas, offset, frames)
+                                               : energy_s32(gate, areas, offset, frames);
+    active = sumsq / (frames * gate->channels) > gate->threshold;
+    if (gate->spectral)
+    {
+        /* filters only run on loud periods, start them from rest each time */
+        if (active)
+            active = voice_ratio(gate, frames) > VAD_BAND_RATIO;
+        else
+        {
+            biquad_reset(&gate->hpf);
+            biquad_reset(&gate->lpf);
+        }
+    }
+
+    keep = 1;
+    if (active)
+    {
+        if (!gate->open)
+        {
+            gate->open = 1;
+            gate->openings++;
+            gate->drain = gate->count;
+        }
+        gate->hang_left = gate->hangover_frames;
+    }
+    else if (gate->open)
+    {
+        /* the period the hangover runs out in is still written */
+        if (gate->hang_left > frames)
+            gate->hang_left -= frames;
+        else
+            gate->open = 0;
+    }
+    else
+    {
+        preroll_store(gate, areas, offset, frames, ts_ns, audio_ns);
+        keep = 0;
+    }
+
+    if (keep)
+        gate->kept += bytes;
+    return keep;
+}
+
+int vad_gate_preroll(struct vad_gate *gate, const snd_pcm_channel_area_t **areas, snd_pcm_uframes_t *frames,
+                     int64_t *ts_ns, int64_t *audio_ns)
+{
+    unsigned int sample_bits = gate->frame_bytes / gate->channels * 8;
+    unsigned int slot, chn;
+
+    if (gate->drain == 0)
+        return 0;
+    slot = (gate->head + gate->nslots - gate->drain) % gate->nslots;
+    gate->drain--;
+    if (gate->drain == 0)
+        gate->count = 0;
+
+    for (chn = 0; chn < gate->channels; chn++)
+    {
+        gate->areas[chn].addr = gate->preroll + (size_t)slot * gate->slot_frames * gate->frame_bytes;
+        gate->areas[chn].first = chn * sample_bits;
+        gate->areas[chn].step = gate->channels * sample_bits;
+    }
+    *areas = gate->areas;
+    *frames = gate->frames[slot];
+    *ts_ns = gate->ts_ns[slot];
+    *audio_ns = gate->audio_ns[slot];
+    gate->kept += *frames * gate->frame_bytes;
+    return 1;
+}
+
+void vad_gate_reset(struct vad_gate *gate)
+{
+    gate->count = 0;
+    gate->drain = 0;
+}
+
+void vad_gate_report(const struct vad_gate *gate, FILE *out)
+{
+    fprintf(out, "Gate: kept %llu of %llu bytes captured (%.1f%%), opened %lu times\n",
+            gate->kept, gate->captured, gate->captured ? 100.0 * gate->kept / gate->captured : 0.0,
+            gate->openings);
+}
@@ -0,0 +1,117 @@
+/*************************************************************************
+ File Name: vad_gate.h
+ Description: Drop silent periods before they are written to disk
+ ************************************************************************/
+
+#ifndef VAD_GATE_H
+#define VAD_GATE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+#define VAD_MAX_CHANNELS    32
+#define VAD_HANGOVER_MS     300     // keep writing this long after the last active period
+#define VAD_PREROLL_MS      200     // and write this much from before the first one
+#define VAD_PREROLL_SLOTS   64      // periods in pre-roll at most, shortens it for tiny periods
+#define VAD_BAND_LOW        300     // voice band(Hz) of the spectral detector
+#define VAD_BAND_HIGH       3400
+#define VAD_BAND_RATIO      0.5     // share of the energy in voice band to count as voice
+
+/*
+ * Every period is judged on its mean square over all channels. A period
+ * above the threshold opens the gate; it closes again once no period has
+ * been above for VAD_HANGOVER_MS. While closed, the latest VAD_PREROLL_MS
+ * are kept in a ring, so the onset that opened the gate is not cut.
+ *
+ * With the spectral detector, loud is not enough: the mono mix also has
+ * to carry most of its energy in the voice band, measured with a band
+ * pass biquad pair. That keeps hum, rumble and hiss out.
+ */
+struct vad_biquad
+{
+    float b0, b1, b2, a1, a2;
+    float x1, x2, y1, y2;
+};
+
+struct vad_gate
+{
+    snd_pcm_format_t format;
+    unsigned int channels;
+    unsigned int rate;
+    unsigned int frame_bytes;
+    double threshold;                   // mean square, normalized to full scale
+    int spectral;
+    unsigned long hangover_frames;
+
+    int open;
+    unsigned long hang_left;            // frames until the gate closes
+    float *mix;                         // mono mix of a period, spectral only
+    struct vad_biquad hpf, lpf;
+
+    /* pre-roll ring, one period per slot, interleaved */
+    unsigned char *preroll;
+    snd_pcm_uframes_t slot_frames;
+    unsigned int nslots;
+    unsigned int head;                  // next slot to fill
+    unsigned int count;                 // slots filled
+    unsigned int drain;                 // slots left to hand out, see vad_gate_preroll()
+    snd_pcm_uframes_t frames[VAD_PREROLL_SLOTS];
+    int64_t ts_ns[VAD_PREROLL_SLOTS];
+    int64_t audio_ns[VAD_PREROLL_SLOTS];
+    snd_pcm_channel_area_t areas[VAD_MAX_CHANNELS];
+
+    /* statistics */
+    unsigned long long captured;        // in byte
+    unsigned long long kept;            // in byte, pre-roll included
+    unsigned long openings;
+};
+
+/*
+ * @brief           Initialize gate
+ * @in format       SND_PCM_FORMAT_S16 or SND_PCM_FORMAT_S32 (native endian)
+ * @in channels     Up to VAD_MAX_CHANNELS
+ * @in max_frames   Largest frame count passed to vad_gate_feed()
+ * @in threshold_db Mean square level(dBFS) that opens the gate
+ * @in spectral     Also require voice band energy to open the gate
+ * @return          0 on success, -1 if format or channels is not supported or no memory
+ */
+int vad_gate_init(struct vad_gate *gate, snd_pcm_format_t format, unsigned int channels,
+                  unsigned int rate, snd_pcm_uframes_t max_frames, float threshold_db, int spectral);
+void vad_gate_free(struct vad_gate *gate);
+
+/*
+ * @brief           Judge a period, call between snd_pcm_mmap_begin() and commit
+ * @in areas        Areas from snd_pcm_mmap_begin()
+ * @in offset       Offset from snd_pcm_mmap_begin()
+ * @in frames       Frames of the period
+ * @in ts_ns        Time the first frame was captured, handed back with the pre-roll
+ * @in audio_ns     Same by the audio clock
+ * @return          1 if the period is to be written, 0 if dropped.
+ *                  When the gate has just opened, write vad_gate_preroll() first
+ */
+int vad_gate_feed(struct vad_gate *gate, const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset,
+                  snd_pcm_uframes_t frames, int64_t ts_ns, int64_t audio_ns);
+
+/*
+ * @brief           Next pre-roll period, oldest first, after vad_gate_feed() opened the gate
+ * @out areas       Interleaved areas of the period, offset 0
+ * @out frames      Frames of the period
+ * @out ts_ns       As passed to vad_gate_feed()
+ * @out audio_ns    As passed to vad_gate_feed()
+ * @return          1 if a period is returned, 0 when the pre-roll is done
+ */
+int vad_gate_preroll(struct vad_gate *gate, const snd_pcm_channel_area_t **areas, snd_pcm_uframes_t *frames,
+                     int64_t *ts_ns, int64_t *audio_ns);
+
+/*
+ * @brief           Forget the pre-roll, e.g. after an xrun it is not contiguous with what follows
+ */
+void vad_gate_reset(struct vad_gate *gate);
+
+/*
+ * @brief           Print kept/captured ratio
+ */
+void vad_gate_report(const struct vad_gate *gate, FILE *out);
+
+#endif
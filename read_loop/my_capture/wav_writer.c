@@ -0,0 +1,111 @@
+/*************************************************************************
+ File Name: wav_writer.c
+ Description: WAV/RF64 header of a recording that is still growing
+ ************************************************************************/
+
+#include <string.h>
+#include "wav_writer.h"
+
+#define WAVE_FORMAT_PCM         0x0001
+#define WAVE_FORMAT_IEEE_FLOAT  0x0003
+#define WAVE_FORMAT_EXTENSIBLE  0xfffe
+
+/* header layout, see wav_writer.h */
+#define DS64_OFFSET     12              // "JUNK"/"ds64" chunk
+#define DS64_SIZE       28
+#define FMT_OFFSET      (DS64_OFFSET + 8 + DS64_SIZE)
+#define DATA_OFFSET     (WAV_HEADER_SIZE - 8)
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+int wav_format_supported(snd_pcm_format_t format)
+{
+    switch (format)
+    {
+        case SND_PCM_FORMAT_U8:
+        case SND_PCM_FORMAT_S16_LE:
+        case SND_PCM_FORMAT_S24_3LE:
+        case SND_PCM_FORMAT_S32_LE:
+        case SND_PCM_FORMAT_FLOAT_LE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+void wav_header_build(unsigned char *hdr, snd_pcm_format_t format, unsigned int channels,
+                      unsigned int rate, uint64_t data_bytes)
+{
+    static const unsigned char guid_tail[14] =
+        {0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71};
+    unsigned int bits = snd_pcm_format_physical_width(format);
+    unsigned int block_align = bits / 8 * channels;
+    uint16_t tag = format == SND_PCM_FORMAT_FLOAT_LE ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+    /* extensible for anything a plain WAVEFORMATEX reader may get wrong */
+    int extensible = channels > 2 || (bits > 16 && tag == WAVE_FORMAT_PCM);
+    uint32_t fmt_size = extensible ? 40 : 16;
+    uint64_t riff_size = WAV_HEADER_SIZE - 8 + data_bytes + (data_bytes & 1);
+    int rf64 = riff_size > UINT32_MAX;
+    unsigned char *p;
+
+    memset(hdr, 0, WAV_HEADER_SIZE);
+
+    memcpy(hdr, rf64 ? "RF64" : "RIFF", 4);
+    put_le32(hdr + 4, rf64 ? UINT32_MAX : riff_size);
+    memcpy(hdr + 8, "WAVE", 4);
+
+    /* ds64, a JUNK chunk of the same size while sizes still fit into 32 bits */
+    p = hdr + DS64_OFFSET;
+    memcpy(p, rf64 ? "ds64" : "JUNK", 4);
+    put_le32(p + 4, DS64_SIZE);
+    if (rf64)
+    {
+        put_le64(p + 8, riff_size);
+        put_le64(p + 16, data_bytes);
+        put_le64(p + 24, data_bytes / block_align);
+        put_le32(p + 32, 0);            // no table
+    }
+
+    p = hdr + FMT_OFFSET;
+    memcpy(p, "fmt ", 4);
+    put_le32(p + 4, fmt_size);
+    put_le16(p + 8, extensible ? WAVE_FORMAT_EXTENSIBLE : tag);
+    put_le16(p + 10, channels);
+    put_le32(p + 12, rate);
+    put_le32(p + 16, rate * block_align);
+    put_le16(p + 20, block_align);
+    put_le16(p + 22, bits);
+    if (extensible)
+    {
+        put_le16(p + 24, 22);                                   // cbSize
+        put_le16(p + 26, snd_pcm_format_width(format));         // valid bits
+        put_le32(p + 28, channels == 1 ? 0x4 : channels == 2 ? 0x3 : 0);   // speaker positions
+        put_le16(p + 32, tag);                                  // sub format GUID
+        memcpy(p + 34, guid_tail, sizeof(guid_tail));
+    }
+
+    /* pad up to the data chunk */
+    p += 8 + fmt_size;
+    memcpy(p, "JUNK", 4);
+    put_le32(p + 4, hdr + DATA_OFFSET - (p + 8));
+
+    p = hdr + DATA_OFFSET;
+    memcpy(p, "data", 4);
+    put_le32(p + 4, rf64 ? UINT32_MAX : data_bytes);
+}
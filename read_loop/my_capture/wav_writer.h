@@ -0,0 +1,35 @@
+/*************************************************************************
+ File Name: wav_writer.h
+ Description: WAV/RF64 header of a recording that is still growing
+ ************************************************************************/
+
+#ifndef WAV_WRITER_H
+#define WAV_WRITER_H
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+/*
+ * The header is padded with a JUNK chunk to exactly WAV_HEADER_SIZE bytes,
+ * so the audio data starts sector aligned (O_DIRECT) and the header can be
+ * rewritten in place at any time without moving data. A 28 byte JUNK chunk
+ * right after "WAVE" reserves room for the RF64 ds64 chunk: once the file
+ * outgrows 4GiB the header turns into RF64 (EBU Tech 3306) in place.
+ */
+#define WAV_HEADER_SIZE     4096
+
+/*
+ * @brief           Whether the sample format can be stored in WAV as is
+ *                  (U8, S16_LE, S24_3LE, S32_LE, FLOAT_LE)
+ */
+int wav_format_supported(snd_pcm_format_t format);
+
+/*
+ * @brief           Build header for `data_bytes` of audio data
+ * @out hdr         WAV_HEADER_SIZE bytes
+ * @in data_bytes   Audio data following the header, in byte
+ */
+void wav_header_build(unsigned char *hdr, snd_pcm_format_t format, unsigned int channels,
+                      unsigned int rate, uint64_t data_bytes);
+
+#endif
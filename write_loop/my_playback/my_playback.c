@@ -4,19 +4,90 @@
  Description: 
  ************************************************************************/
 #include "my_playback.h"
+#ifdef MY_PLAYBACK_ALLOC_COUNT
+#include <errno.h>
+#include <stdatomic.h>
+#endif
 
 /**********************
  * Globals
  **********************/
-volatile sig_atomic_t signal_pause_switch = 1;  // 1 pause, 0 resume
 #ifdef MY_PLAYBACK_DEBUG
     static snd_output_t *output;
 #endif
+#ifdef MY_PLAYBACK_ALLOC_COUNT
+    static volatile sig_atomic_t alloc_count_armed = 0;
+    static atomic_ulong alloc_count = 0;    // allocations made while armed, by any thread
+#endif
 
 /**********************
  * Functions
  **********************/
 
+#ifdef MY_PLAYBACK_ALLOC_COUNT
+/*
+ * Interpose the allocator entry points so that allocations done inside
+ * alsa-lib are counted as well, while `alloc_count_armed` is set.
+ * This relies on glibc: the wrappers forward to its __libc_* entry points,
+ * and its strdup(), asprintf() etc. allocate through the malloc() here.
+ * free() is left alone, the memory still comes from the glibc allocator.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static inline void alloc_count_add(void)
+{
+    if (alloc_count_armed)
+        atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+}
+
+void *malloc(size_t size)
+{
+    alloc_count_add();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    alloc_count_add();
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    alloc_count_add();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    alloc_count_add();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    alloc_count_add();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    alloc_count_add();
+    p = __libc_memalign(alignment, size);
+    if (p == NULL && size != 0)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+#endif
+
 /*
  * @brief       Echo an error message
  */
@@ -26,113 +97,178 @@ static void pr_error(const char *msg, int err)
 }
 
 /*
- * @brief           Generate sine wave data
- * @in handle       Handler for PCM device, from which we can fetch all information
- * @in|out buf      Buffer in which we need to fill in sine wave data
- * @in buf_size     Indicate length of buffer
- * @in freq         Requested frequency
- * @in|out phase    Sine wave starting phase
+ * @brief       Microseconds elapsed from `start` to `end`
  */
+static long timespec_diff_us(const struct timespec *end, const struct timespec *start)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000;
+}
 
-static void generate_sine_wave(snd_pcm_t *handle, char *buf, ssize_t buf_size, unsigned int freq, double *phase)
+/*
+ * @brief       Read all pending signals from pause fd
+ * @return      Count of pause toggles read
+ */
+static int read_pause_toggles(int pause_fd)
 {
-    snd_pcm_hw_params_t *hw_params; 
-    snd_pcm_format_t format;
-    snd_pcm_uframes_t period_size;
-    unsigned int chn;
-    unsigned int fs;
-    int format_width;               // in bit
-    int bps;                        // in byte
-    int format_physical_width;      // in bit
-    int phys_bps;                   // in byte
-    int is_big_endian;
-    int is_unsigned; // only for linear format
-    int is_float;    // FIXME: not sure if float is linear or non-linear(*)
-
-    unsigned int max_value;
-    double step;
-    int frame, ch, i, offset;
-
-    union {
-        float f;
-        int i;
-    } val;
-    int res;
-
-    /* Retrieve current hardware parameters */
-    snd_pcm_hw_params_malloc(&hw_params);
-    snd_pcm_hw_params_current(handle, hw_params);
-    snd_pcm_hw_params_get_period_size(hw_params, &period_size, 0);
-    snd_pcm_hw_params_get_format(hw_params, &format);
-    snd_pcm_hw_params_get_channels(hw_params, &chn);
-    snd_pcm_hw_params_get_rate(hw_params, &fs, 0);
-    format_width = snd_pcm_format_width(format);
-    bps = format_width / 8;
-    format_physical_width = snd_pcm_format_physical_width(format);
-    phys_bps = format_physical_width / 8;
-    is_big_endian = snd_pcm_format_big_endian(format) == 1;
-    is_unsigned = snd_pcm_format_unsigned(format) == 1;
-    is_float = snd_pcm_format_float(format) == 1;
-
-    step = 2 * M_PI * freq / fs;
-
-    for (frame = 0; frame < period_size; frame++)
+    struct signalfd_siginfo si;
+    int toggles = 0;
+
+    while (read(pause_fd, &si, sizeof(si)) == sizeof(si))
     {
-        /* update phase */
-        *phase += step;
-        if (*phase > 2*M_PI)
-        {
-            *phase -= 2*M_PI;
-        }
+        toggles++;
+    }
+    return toggles;
+}
 
-        /* calculate value */
-        if (is_float)
-        {
-            val.f = sin(*phase);
-            res = val.i;
-        }
-        else
+/*
+ * @brief       Send a progress notification, see struct playback_event
+ */
+void notify_event(int notify_fd, enum playback_event_type type)
+{
+    struct playback_event ev;
+
+    if (notify_fd < 0)
+        return;
+    ev.type = type;
+    clock_gettime(CLOCK_MONOTONIC, &ev.ts);
+    if (write(notify_fd, &ev, sizeof(ev)) != sizeof(ev))
+    {
+        perror("notify event failed");
+    }
+}
+
+/*
+ * @brief       Wait for a progress notification of the given type
+ * @return      0 on success, -1 if the peer is gone
+ */
+static int wait_event(int notify_fd, enum playback_event_type type, struct playback_event *ev)
+{
+    while (read(notify_fd, ev, sizeof(*ev)) == sizeof(*ev))
+    {
+        if (ev->type == type)
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * @brief       Pause or resume the device, if it is in a state allowing so
+ */
+static void set_device_paused(snd_pcm_t *handle, int pause)
+{
+    snd_pcm_state_t state = snd_pcm_state(handle);
+    int err;
+
+    if (pause && state == SND_PCM_STATE_RUNNING)
+    {
+        err = snd_pcm_pause(handle, 1);
+        if (err < 0)
         {
-            int pos_peak = (1 << (format_width-1))-1;
-            res = sin(*phase) * pos_peak;
+            pr_error("To pause failed", err);
         }
-        // FIXME check if here needs to handle "float" format also
-        if (is_unsigned)
+    }
+    else if (!pause && state == SND_PCM_STATE_PAUSED)
+    {
+        err = snd_pcm_pause(handle, 0);
+        if (err < 0)
         {
-            res ^= (1U <<(format_width-1));
+            pr_error("Leave pause failed", err);
         }
-        for (ch = 0; ch < chn; ch++)
+    }
+}
+
+/*
+ * @brief           Generate sine wave data
+ * @in desc         Stream descriptor, see prepare_device()
+ * @in areas        Channel areas to fill in, either over a local buffer or the mmap'd ring buffer
+ * @in offset       Offset of the first frame in `areas`
+ * @in frames       Frames to generate, at most one period
+ * @in|out bank     Voices to mix, their phases are advanced by `frames`
+ */
+
+static void generate_sine_wave(const struct stream_desc *desc, const snd_pcm_channel_area_t *areas,
+                               snd_pcm_uframes_t offset, snd_pcm_uframes_t frames,
+                               struct osc_bank *bank)
+{
+    int ch;
+
+    /* mix the whole period in float, then every channel is one strided store loop */
+    osc_bank_render(bank, frames);
+    for (ch = 0; ch < desc->channels; ch++)
+    {
+        unsigned int step = areas[ch].step / 8;     // in byte
+        char *addr = (char*)areas[ch].addr + areas[ch].first / 8 + offset * step;
+
+        desc->pack(addr, step, osc_bank_channel(bank, ch), frames);
+    }
+}
+
+/*
+ * @brief           Generate up to one period straight into the mmap'd ring buffer, no copy
+ * @in max_frames   Frames wanted, at most one period. Less are written if ring buffer is fuller
+ * @return          Frames committed, or negative error code
+ */
+static snd_pcm_sframes_t mmap_write_period(snd_pcm_t *handle, const struct stream_desc *desc,
+                                           struct osc_bank *bank, snd_pcm_uframes_t max_frames)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames, size;
+    snd_pcm_sframes_t avail, commitres, written = 0;
+    int err;
+
+    avail = snd_pcm_avail_update(handle);
+    if (avail < 0)
+        return avail;
+    if (avail == 0 && desc->nonblock)
+        return -EAGAIN;
+    size = (snd_pcm_uframes_t)avail < max_frames ? (snd_pcm_uframes_t)avail : max_frames;
+
+    /* the period may wrap around the end of ring buffer, so maybe two chunks */
+    while (size > 0)
+    {
+        frames = size;
+        err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+        if (err < 0)
+            return err;
+        generate_sine_wave(desc, areas, offset, frames, bank);
+        commitres = snd_pcm_mmap_commit(handle, offset, frames);
+        if (commitres < 0)
+            return commitres;
+        if ((snd_pcm_uframes_t)commitres != frames)
+            return -EPIPE;
+        size -= frames;
+        written += frames;
+    }
+
+    /* Unlike snd_pcm_writei(), committing doesn't check start_threshold, so
+     * start the device ourselves once enough is queued */
+    if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED)
+    {
+        avail = snd_pcm_avail_update(handle);
+        if (avail >= 0 && desc->buffer_size - avail >= desc->start_threshold)
         {
-            for (i = 0; i < bps; i++)  // only loop to bps since the residential bits are just ignored
-            {
-                if (is_big_endian)
-                {
-                    offset = phys_bps - 1 - i; // set lower part of resutl to higher addressed memory
-                }
-                else
-                {
-                    offset = i; // set lower part of result to lower addressed memory
-                }
-                *(buf + ch*phys_bps + frame*chn*phys_bps + offset) = (res >> i*8) & 0xff;
-            }
+            err = snd_pcm_start(handle);
+            if (err < 0)
+                return err;
         }
     }
-
-    snd_pcm_hw_params_free(hw_params);
+    return written;
 }
 
 /*
  * Prepare device to playback
  * @in device_name          PCM device name which will play audio
+ * @in access               Access type, RW_INTERLEAVED or one of the MMAP ones
+ * @in mode                 Open mode, 0 or SND_PCM_NONBLOCK
  * @out handle              Handler to the opened PCM device
+ * @out desc                Negotiated stream configuration, reused by playback()
  */
-void prepare_device(const char *device_name, snd_pcm_t **handle)
+void prepare_device(const char *device_name, snd_pcm_access_t access, int mode, snd_pcm_t **handle, struct stream_desc *desc)
 {
     const snd_pcm_format_t format    = SND_PCM_FORMAT_S16_LE;
     const unsigned int chn           = 2;       //stero
     unsigned int fs                  = 44100;
     unsigned int period_time         = 400000;  // us
-    snd_pcm_uframes_t period_size;              // in frame
     unsigned int buffer_time         = 800000;  // us
     snd_pcm_uframes_t buffer_size;              // in frame
     int can_pause;
@@ -147,7 +283,7 @@ void prepare_device(const char *device_name, snd_pcm_t **handle)
 #endif
 
     /* open PCM device for playback */
-    err = snd_pcm_open(handle, device_name, SND_PCM_STREAM_PLAYBACK, 0);
+    err = snd_pcm_open(handle, device_name, SND_PCM_STREAM_PLAYBACK, mode);
     if (err < 0)
     {
         pr_error("Open PCM device failed", err);
@@ -158,11 +294,15 @@ void prepare_device(const char *device_name, snd_pcm_t **handle)
     snd_pcm_hw_params_malloc(&hw_params);
     snd_pcm_hw_params_any(*handle, hw_params);
     
-    snd_pcm_hw_params_set_access(*handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED); //interleaved
+    err = snd_pcm_hw_params_set_access(*handle, hw_params, access);
+    if (err < 0)
+    {
+        fprintf(stderr, "Access type %s not available: %s\n", snd_pcm_access_name(access), snd_strerror(err));
+        exit(1);
+    }
     snd_pcm_hw_params_set_rate_near(*handle, hw_params, &fs, 0);
 
     snd_pcm_hw_params_set_period_time_near(*handle, hw_params, &period_time, 0);
-    snd_pcm_hw_params_get_period_size(hw_params, &period_size, 0);
 
     snd_pcm_hw_params_set_buffer_time_near(*handle, hw_params, &buffer_time, 0);
     snd_pcm_hw_params_get_buffer_size(hw_params, &buffer_size);
@@ -178,6 +318,29 @@ void prepare_device(const char *device_name, snd_pcm_t **handle)
     }
     can_pause = snd_pcm_hw_params_can_resume(hw_params) == 1;
 
+    /* Fill stream descriptor from what the device actually accepted */
+    desc->access = access;
+    desc->nonblock = (mode & SND_PCM_NONBLOCK) != 0;
+    desc->format = format;
+    desc->format_width = snd_pcm_format_width(format);
+    desc->phys_bps = snd_pcm_format_physical_width(format) / 8;
+    desc->is_big_endian = snd_pcm_format_big_endian(format) == 1;
+    desc->is_unsigned = snd_pcm_format_unsigned(format) == 1;
+    desc->is_float = snd_pcm_format_float(format) == 1;
+    desc->pack = sample_pack_select(format);
+    if (desc->pack == NULL)
+    {
+        fprintf(stderr, "Sample format %s not supported by generator\n", snd_pcm_format_name(format));
+        exit(1);
+    }
+    snd_pcm_hw_params_get_channels(hw_params, &desc->channels);
+    snd_pcm_hw_params_get_rate(hw_params, &desc->rate, 0);
+    snd_pcm_hw_params_get_period_time(hw_params, &desc->period_time, 0);
+    snd_pcm_hw_params_get_period_size(hw_params, &desc->period_size, 0);
+    snd_pcm_hw_params_get_buffer_size(hw_params, &desc->buffer_size);
+    desc->frame_bytes = snd_pcm_frames_to_bytes(*handle, 1);
+    desc->start_threshold = desc->period_size * 2;
+
 #ifdef MY_PLAYBACK_DEBUG
     snd_pcm_dump_hw_setup(*handle, output);
 
@@ -196,7 +359,8 @@ void prepare_device(const char *device_name, snd_pcm_t **handle)
 
     snd_pcm_sw_params_malloc(&sw_params);
     snd_pcm_sw_params_current(*handle, sw_params);
-    snd_pcm_sw_params_set_start_threshold(*handle, sw_params, period_size * 2);
+    snd_pcm_sw_params_set_start_threshold(*handle, sw_params, desc->start_threshold);
+    snd_pcm_sw_params_set_avail_min(*handle, sw_params, desc->period_size);   // wake up only for a whole period
     snd_pcm_sw_params(*handle, sw_params);
 
 #ifdef MY_PLAYBACK_DEBUG
@@ -212,31 +376,44 @@ void prepare_device(const char *device_name, snd_pcm_t **handle)
 /*
  * @brief                   Playback 
  * @in handle               PCM handler
+ * @in desc                 Stream descriptor filled by prepare_device()
+ * @in ctl                  Runtime controls, see struct playback_ctl
  * @in duration             Duration of the play in us. 0 forever play.
  */
 
-void playback(snd_pcm_t *handle, unsigned int duration)
+void playback(snd_pcm_t *handle, const struct stream_desc *desc, const struct playback_ctl *ctl, unsigned int duration)
 {
-    snd_pcm_hw_params_t *hw_params; 
-    snd_pcm_uframes_t period_size;
-    unsigned int period_time;
+    snd_pcm_uframes_t period_size = desc->period_size;
+    unsigned int period_time = desc->period_time;
     char *buf;
     ssize_t buf_size;                           // in byte
     int playcnt, i;
-    unsigned freq = 4000;                      // sine wave frequency(Hz)
-    double phase = 0.0;
     int err;
-    int is_paused = 1;                         // if PCM device is paused: 1: paused; 0: not paused
+    uint32_t event;
+    int is_paused;                             // if playback is paused: 1: paused; 0: not paused
+    struct pollfd *pfds;                       // [pause fd] + PCM descriptors
+    int nfds, pcm_nfds, first_pcm_fd;
+    unsigned short revents;
+    int resume_pending = 0;                    // resumed, first write after it not done yet
+    int first_frame_pending = 1;               // nothing written to the device yet
+    struct timespec paused_at, paused_cpu;     // when pause started (monotonic/thread CPU time)
+    struct timespec resumed_at, now, now_cpu;
+    int mmap_mode = desc->access != SND_PCM_ACCESS_RW_INTERLEAVED;
+    snd_pcm_channel_area_t *rw_areas;          // areas over `buf`, for RW access
+    unsigned long periods_written = 0;
+    unsigned long long bytes_copied = 0;       // copied from `buf` into ring buffer by snd_pcm_writei()
+    snd_pcm_uframes_t frames_left;             // of current period
+    snd_pcm_sframes_t written;
+    int generated;                             // current period is in `buf` already
+    unsigned long wakeups = 0, short_writes = 0;
+    struct timespec stat_since;                // wakeup statistics counted since
+    int ch;
 
 #ifdef MY_PLAYBACK_DEBUG
-    printf("Sine wave frequency is %dHz\n", freq);
+    printf("Access type is %s\n", snd_pcm_access_name(desc->access));
+    printf("Sine wave voices: %u\n", ctl->bank->nvoices);
 #endif
 
-    snd_pcm_hw_params_malloc(&hw_params);
-    snd_pcm_hw_params_current(handle, hw_params);
-    snd_pcm_hw_params_get_period_size(hw_params, &period_size, 0);
-    snd_pcm_hw_params_get_period_time(hw_params, &period_time, 0);
-
 #ifdef MY_PLAYBACK_DEBUG
     /* Check return value of `snd_pcm_avail_update` for playback device
      * The API document says:
@@ -246,11 +423,43 @@ void playback(snd_pcm_t *handle, unsigned int duration)
 
     /* Allocate a buffer to contain all samples in one period
      * sample count == period_size(frame) * channel_cnt * byte per sample
-     * or 
-     * use snd_pcm_frames_to_bytes() API
      */
-    buf_size = snd_pcm_frames_to_bytes(handle, period_size);
+    buf_size = period_size * desc->frame_bytes;
     buf = (char*)malloc(buf_size);
+    rw_areas = (snd_pcm_channel_area_t*)malloc(desc->channels * sizeof(snd_pcm_channel_area_t));
+    for (ch = 0; ch < desc->channels; ch++)
+    {
+        rw_areas[ch].addr = buf;
+        rw_areas[ch].first = ch * desc->phys_bps * 8;
+        rw_areas[ch].step = desc->frame_bytes * 8;
+    }
+
+    /* Poll set: pause fd (if any) followed by the PCM descriptors. Start paused
+     * when the caller controls pausing, so that nothing plays before it says so */
+    first_pcm_fd = ctl->pause_fd >= 0 ? 1 : 0;
+    pcm_nfds = snd_pcm_poll_descriptors_count(handle);
+    if (pcm_nfds <= 0)
+    {
+        fprintf(stderr, "Invalid poll descriptors count\n");
+        exit(1);
+    }
+    nfds = first_pcm_fd + pcm_nfds;
+    pfds = (struct pollfd*)malloc(nfds * sizeof(struct pollfd));
+    if (ctl->pause_fd >= 0)
+    {
+        pfds[0].fd = ctl->pause_fd;
+        pfds[0].events = POLLIN;
+    }
+    err = snd_pcm_poll_descriptors(handle, pfds + first_pcm_fd, pcm_nfds);
+    if (err < 0)
+    {
+        pr_error("Unable to obtain poll descriptors", err);
+        exit(1);
+    }
+    is_paused = ctl->pause_fd >= 0;
+    clock_gettime(CLOCK_MONOTONIC, &paused_at);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &paused_cpu);
+    stat_since = paused_at;
 
     /* Determine how many periods to output or if play forever */
     if (duration != 0)
@@ -303,6 +512,10 @@ void playback(snd_pcm_t *handle, unsigned int duration)
     fprintf(stdout, "%s\n", snd_pcm_state_name(snd_pcm_state(handle)));
     */
 
+#ifdef MY_PLAYBACK_ALLOC_COUNT
+    atomic_store(&alloc_count, 0);
+    alloc_count_armed = 1;
+#endif
     for (i = 0; i < playcnt; i++)
     {
         /* Iterate from 0 if we want play in whole lifetime */
@@ -310,8 +523,6 @@ void playback(snd_pcm_t *handle, unsigned int duration)
         {
             i = 0; // forever play
         }
-        generate_sine_wave(handle, buf, buf_size, freq, &phase);
-
         /* Since PCM is opened in BLOCK mode, the routine waits until all requested samples
          * are put to the playback ring buffer. In which case, playback ring buffer will never
          * overflow.
@@ -319,133 +530,377 @@ void playback(snd_pcm_t *handle, unsigned int duration)
          * However, if this process doesn't feed new samples to ring buffer in time. An underrun
          * occurs. Which will return value less than requested. Need to recover/prepare, i.e.
          * prepare for next I/O.
+         *
+         * In NONBLOCK mode a write only takes what fits, the rest of the period is written
+         * after the next wakeup.
          */
-
-        /* Puase handling */
-        while (signal_pause_switch) // parent process says to pause
+        frames_left = period_size;
+        generated = 0;
+        while (frames_left > 0)
         {
-            if (!is_paused)
+            /* Pause handling and waiting for room in ring buffer (at least avail_min frames).
+             * While paused only the pause fd is polled, so a paused stream sleeps in
+             * poll() until the next toggle arrives, and it is served within one period
+             * while playing. */
+            while (1)
             {
-                err = snd_pcm_pause(handle, 1);
-                if (err < 0)
+                if (poll(pfds, is_paused ? 1 : nfds, -1) < 0)
                 {
-                    pr_error("To pause failed", err);
+                    if (errno == EINTR)
+                        continue;
+                    perror("poll failed");
+                    break;
                 }
-                is_paused = 1;
+                if (ctl->pause_fd >= 0 && (pfds[0].revents & POLLIN))
+                {
+                    if (read_pause_toggles(ctl->pause_fd) % 2 == 0)
+                        continue;
+                    is_paused = !is_paused;
+                    if (is_paused)
+                    {
+                        set_device_paused(handle, 1);
+                        clock_gettime(CLOCK_MONOTONIC, &paused_at);
+                        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &paused_cpu);
+                    }
+                    else
+                    {
+                        clock_gettime(CLOCK_MONOTONIC, &resumed_at);
+                        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now_cpu);
+                        fprintf(stdout, "Paused for %ld ms, CPU time while paused: %ld us\n",
+                                timespec_diff_us(&resumed_at, &paused_at) / 1000,
+                                timespec_diff_us(&now_cpu, &paused_cpu));
+                        set_device_paused(handle, 0);
+                        resume_pending = 1;
+                        stat_since = resumed_at;
+                        wakeups = short_writes = 0;
+                    }
+                    continue;
+                }
+                if (is_paused)
+                    continue;
+                wakeups++;
+                snd_pcm_poll_descriptors_revents(handle, pfds + first_pcm_fd, pcm_nfds, &revents);
+                if (revents & (POLLOUT | POLLERR))
+                    break;  // room for data, or an error reported by the write below
             }
-        }
-        if (is_paused)
-        {
-            err = snd_pcm_pause(handle, 0);
-            if (err < 0)
+
+            /* write data to ring buffer, in mmap mode generate right into it */
+            if (mmap_mode)
             {
-                pr_error("Leave pause failed", err);
+                written = mmap_write_period(handle, desc, ctl->bank, frames_left);
+            }
+            else
+            {
+                if (!generated)
+                {
+                    generate_sine_wave(desc, rw_areas, 0, period_size, ctl->bank);
+                    generated = 1;
+                }
+                written = snd_pcm_writei(handle, buf + (period_size - frames_left) * desc->frame_bytes, frames_left);
+                if (written > 0)
+                    bytes_copied += (unsigned long long)written * desc->frame_bytes;
             }
-            is_paused = 0;
-        }
-
-        /* write data to ring buffer */
-        err = snd_pcm_writei(handle, buf, period_size);
 
-        /* only when device is opened in NONBLOCK mode */
-        if (err == -EAGAIN)
-        {
-            continue;
-        }
-        /* Underrun occr */
-        else if (err == -EPIPE)
-        {
-            pr_error("Underrun occur", err);
-            err = snd_pcm_prepare(handle);
-            if (err < 0)
-                pr_error("Can't recover from underrun, prepare failed", err);
-        }
-        /* Device suspended */
-        else if (err == -ESTRPIPE)
-        {
-            while ((err = snd_pcm_resume(handle)) == -EAGAIN)
+            /* only when device is opened in NONBLOCK mode, woke up too early */
+            if (written == -EAGAIN)
             {
-                sleep(1);
+                continue;
             }
-            if (err < 0)
+            /* Underrun occr */
+            else if (written == -EPIPE)
             {
+                event = xrun_telemetry_event(ctl->telemetry, handle, 0, written);
+                pr_error("Underrun occur", written);
                 err = snd_pcm_prepare(handle);
                 if (err < 0)
-                    pr_error("Can't recover from suspend, prepare failed", err);
+                    pr_error("Can't recover from underrun, prepare failed", err);
+                xrun_telemetry_recovered(ctl->telemetry, event, err);
+                break;  // skip rest of the period
+            }
+            /* Device suspended */
+            else if (written == -ESTRPIPE)
+            {
+                event = xrun_telemetry_event(ctl->telemetry, handle, 0, written);
+                while ((err = snd_pcm_resume(handle)) == -EAGAIN)
+                {
+                    sleep(1);
+                }
+                if (err < 0)
+                {
+                    err = snd_pcm_prepare(handle);
+                    if (err < 0)
+                        pr_error("Can't recover from suspend, prepare failed", err);
+                }
+                xrun_telemetry_recovered(ctl->telemetry, event, err);
+                break;
+            }
+            /* Other error cases */
+            else if (written < 0)
+            {
+                event = xrun_telemetry_event(ctl->telemetry, handle, 0, written);
+                pr_error("Other error occur", written);
+                err = snd_pcm_recover(handle, written, 0);
+                if (err < 0)
+                    pr_error("Can't recover from other error, recover failed", err);
+                xrun_telemetry_recovered(ctl->telemetry, event, err);
+                break;
+            }
+            else if (written < frames_left)
+            {
+                short_writes++;
+                if (!desc->nonblock)
+                    fprintf(stderr, "Short write, write %d frames\n", (int)written);
+            }
+            frames_left -= written;
+
+            if (first_frame_pending && written > 0)
+            {
+                notify_event(ctl->notify_fd, PLAYBACK_EVENT_FIRST_FRAME);
+                first_frame_pending = 0;
+            }
+            if (resume_pending && written > 0)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                fprintf(stdout, "Resume latency: %ld us\n", timespec_diff_us(&now, &resumed_at));
+                resume_pending = 0;
             }
         }
-        /* Other error cases */
-        else if (err < 0)
-        {
-            pr_error("Other error occur", err);
-            err = snd_pcm_recover(handle, err, 0);
-            if (err < 0)
-                pr_error("Can't recover from other error, recover failed", err);
-        }
-        else if (err < period_size)
+        if (frames_left == 0)
+            periods_written++;
+
+#ifdef MY_PLAYBACK_DEBUG
+        /* wakeup statistics, once a second of playing */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!is_paused && timespec_diff_us(&now, &stat_since) >= 1000000)
         {
-            fprintf(stderr, "Short write, write %d frames\n", err);
+            double sec = timespec_diff_us(&now, &stat_since) / 1e6;
+
+            fprintf(stdout, "Wakeups: %.1f/s, short writes: %.1f/s\n", wakeups / sec, short_writes / sec);
+            wakeups = short_writes = 0;
+            stat_since = now;
         }
+#endif
     }
     
+#ifdef MY_PLAYBACK_ALLOC_COUNT
+    alloc_count_armed = 0;
+    fprintf(stdout, "Heap allocations in playback loop: %lu\n", atomic_load(&alloc_count));
+#endif
+    fprintf(stdout, "Bytes copied per period: %llu\n", periods_written ? bytes_copied / periods_written : 0);
+
     /* Clear */
-    snd_pcm_hw_params_free(hw_params);
+    free(pfds);
+    free(rw_areas);
     free(buf);
 }
 
 
 #ifdef MY_PLAYBACK_MAIN
+#define MAX_TONES   64                  // voices given with -t
+#define MAX_VOICES  100000              // voices generated with -n, several cores' worth
+
+/* Voice given on command line */
+struct tone_spec
+{
+    double freq;
+    float gain;
+    unsigned long route;
+};
+
 /*
- * @brief           Switch pause switcher for playing
+ * @brief           Print usage
  */
-void pause_switch(int sig)
+static void help(void)
 {
-    signal_pause_switch = signal_pause_switch? 0:1; 
+    printf(
+"Usage: my_playback [OPTION]...\n"
+"-h,--help      help\n"
+"-D,--device    playback device\n"
+"-a,--access    access type: RW_INTERLEAVED, MMAP_INTERLEAVED or MMAP_NONINTERLEAVED\n"
+"-t,--tone      add a voice: freq[:gain[:route]], route is a hex channel mask (repeatable)\n"
+"-n,--voices    add N voices spread over 100..8000Hz and round robin over channels\n"
+"-N,--nonblock  open device in non-blocking mode\n"
+"\n");
 }
 
-
 /*
  * MAIN
  */
-void main()
+int main(int argc, char *argv[])
 {
+    struct option long_option[] =
+    {
+        {"help", 0, NULL, 'h'},
+        {"device", 1, NULL, 'D'},
+        {"access", 1, NULL, 'a'},
+        {"tone", 1, NULL, 't'},
+        {"voices", 1, NULL, 'n'},
+        {"nonblock", 0, NULL, 'N'},
+        {NULL, 0, NULL, 0},
+    };
+    struct tone_spec tones[MAX_TONES];
+    unsigned int ntones = 0;
+    unsigned int nvoices = 0;                 // generated voices for load testing
+    unsigned long voices;
+    char *end;
+    const char *device_name = "hw:0,1";
+    snd_pcm_access_t access = SND_PCM_ACCESS_RW_INTERLEAVED;
+    int open_mode = 0;
+    int c;
     pid_t ch_pid;
-    struct sigaction user_action;
-    sigset_t block_mask;
+    sigset_t pause_mask;
+    int notify_pipe[2];                     // child -> parent progress notification
+    struct playback_event ev;
+    struct timespec forked_at, started_at;
+
+    while ((c = getopt_long(argc, argv, "hD:a:t:n:N", long_option, NULL)) >= 0)
+    {
+        switch (c)
+        {
+            case 'D':
+                device_name = optarg;
+                break;
+            case 'a':
+                for (access = 0; access <= SND_PCM_ACCESS_LAST; access++)
+                {
+                    if (snd_pcm_access_name(access) && !strcasecmp(snd_pcm_access_name(access), optarg))
+                        break;
+                }
+                if (access != SND_PCM_ACCESS_RW_INTERLEAVED &&
+                    access != SND_PCM_ACCESS_MMAP_INTERLEAVED &&
+                    access != SND_PCM_ACCESS_MMAP_NONINTERLEAVED)
+                {
+                    fprintf(stderr, "Unsupported access type %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                if (ntones == MAX_TONES)
+                {
+                    fprintf(stderr, "Too many tones, at most %d\n", MAX_TONES);
+                    return 1;
+                }
+                tones[ntones].gain = 1.0f;
+                tones[ntones].route = OSC_BANK_ROUTE_ALL;
+                if (sscanf(optarg, "%lf:%f:%lx", &tones[ntones].freq, &tones[ntones].gain, &tones[ntones].route) < 1)
+                {
+                    fprintf(stderr, "Invalid tone %s\n", optarg);
+                    return 1;
+                }
+                ntones++;
+                break;
+            case 'n':
+                errno = 0;
+                voices = strtoul(optarg, &end, 10);
+                if (errno || end == optarg || *end || optarg[0] == '-' || voices > MAX_VOICES)
+                {
+                    fprintf(stderr, "Invalid voice count %s, 0 to %d\n", optarg, MAX_VOICES);
+                    return 1;
+                }
+                nvoices = voices;
+                break;
+            case 'N':
+                open_mode |= SND_PCM_NONBLOCK;
+                break;
+            default:
+                help();
+                return 0;
+        }
+    }
 
-    /* Establish the signal handler */
-    sigfillset(&block_mask);
-    user_action.sa_handler = pause_switch;
-    user_action.sa_mask = block_mask;
-    user_action.sa_flags = 0;
-    sigaction(SIGUSR1, &user_action, NULL);
+    /* SIGUSR1 toggles pause. It is blocked before fork, so it is never delivered
+     * to the child asynchronously but read from a signalfd in its poll loop */
+    sigemptyset(&pause_mask);
+    sigaddset(&pause_mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &pause_mask, NULL);
+
+    if (pipe(notify_pipe) < 0)
+    {
+        perror("pipe failed");
+        exit(1);
+    }
 
     /* Create the child process */
+    clock_gettime(CLOCK_MONOTONIC, &forked_at);
     if ((ch_pid = fork()) < 0)
     {
         fprintf(stderr, "Fork failed\n");
     }
     else if (ch_pid == 0)  /* child */
     {
-        const char *device_name = "hw:0,1";
         snd_pcm_t *handle;
+        struct stream_desc desc;
+        struct playback_ctl ctl;
+        struct osc_bank bank;
+        struct xrun_telemetry telemetry;
+        unsigned int k;
         unsigned int duration = 10000000; 
         //unsigned int duration = 0; 
 
-        prepare_device(device_name, &handle);
-        playback(handle, duration);
+        close(notify_pipe[0]);
+        ctl.notify_fd = notify_pipe[1];
+        ctl.pause_fd = signalfd(-1, &pause_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (ctl.pause_fd < 0)
+        {
+            perror("signalfd failed");
+            exit(1);
+        }
+
+        prepare_device(device_name, access, open_mode, &handle, &desc);
+
+        /* One 4000Hz tone on all channels unless told otherwise */
+        if (osc_bank_init(&bank, ntones + nvoices ? ntones + nvoices : 1, desc.channels, desc.period_size) < 0)
+        {
+            fprintf(stderr, "No enough memory for %u voices\n", ntones + nvoices);
+            exit(1);
+        }
+        if (ntones + nvoices == 0)
+        {
+            osc_bank_add(&bank, 4000, desc.rate, 1.0f, OSC_BANK_ROUTE_ALL);
+        }
+        for (k = 0; k < ntones; k++)
+        {
+            osc_bank_add(&bank, tones[k].freq, desc.rate, tones[k].gain, tones[k].route);
+        }
+        for (k = 0; k < nvoices; k++)
+        {
+            osc_bank_add(&bank, 100.0 + k * 7900.0 / nvoices, desc.rate, 1.0f / nvoices, 1UL << (k % desc.channels % OSC_BANK_MAX_CHANNELS));
+        }
+        ctl.bank = &bank;
+        if (xrun_telemetry_open(&telemetry, argv[0]) < 0)
+            perror("No xrun telemetry");
+        ctl.telemetry = &telemetry;
+
+        notify_event(ctl.notify_fd, PLAYBACK_EVENT_PREPARED);
+        playback(handle, &desc, &ctl, duration);
 
+        snd_pcm_nonblock(handle, 0);    // let drain wait
         snd_pcm_drain(handle);
         snd_pcm_close(handle);
+        close(ctl.pause_fd);
+        close(ctl.notify_fd);
+        osc_bank_free(&bank);
+        xrun_telemetry_close(&telemetry);
         printf("Child exit\n");
         exit(0);
     }
     else                /* parent */
     {
-        sleep(2);      // FIXME need sync waiting for PCM device prepared
-        fprintf(stdout, "PCM device should be ready...\n");
+        close(notify_pipe[1]);
+        if (wait_event(notify_pipe[0], PLAYBACK_EVENT_PREPARED, &ev) < 0)
+        {
+            fprintf(stderr, "Child exited before PCM device prepared\n");
+            exit(1);
+        }
+        fprintf(stdout, "PCM device prepared in %ld ms\n", timespec_diff_us(&ev.ts, &forked_at) / 1000);
+        clock_gettime(CLOCK_MONOTONIC, &started_at);
         kill(ch_pid, SIGUSR1);
         fprintf(stdout, "Let's play!\n");
+        if (wait_event(notify_pipe[0], PLAYBACK_EVENT_FIRST_FRAME, &ev) == 0)
+        {
+            fprintf(stdout, "Time to first frame: %ld us after start, %ld ms after fork\n",
+                    timespec_diff_us(&ev.ts, &started_at), timespec_diff_us(&ev.ts, &forked_at) / 1000);
+        }
         sleep(2);
         fprintf(stdout, "Let's stop for a while!\n");
         kill(ch_pid, SIGUSR1);
@@ -453,7 +908,9 @@ void main()
         fprintf(stdout, "Let's play (again)!\n");
         kill(ch_pid, SIGUSR1);
         sleep(2);
+        close(notify_pipe[0]);
         printf("Parent exit\n");
     }
+    return 0;
 }
 #endif
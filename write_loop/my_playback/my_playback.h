@@ -13,17 +13,76 @@
 #include <signal.h>
 #include <math.h>
 #include <limits.h>
+#include <time.h>
+#include <sys/signalfd.h>
+#include <getopt.h>
+#include "osc_bank.h"
+#include "sample_pack.h"
+#include "xrun_telemetry.h"
 
 /**************
  * Build macros
  *************/
 #define MY_PLAYBACK_DEBUG               // output debug info
 #define MY_PLAYBACK_MAIN                // my_playback works as a process
+/* MY_PLAYBACK_ALLOC_COUNT counts heap allocations made in playback loop,
+ * glibc only, enable with cmake -DMY_PLAYBACK_ALLOC_COUNT=ON */
+
+/**************
+ * Types
+ *************/
+/* Stream configuration negotiated by prepare_device(), so that nothing
+ * needs to be queried from the device on the real-time path */
+struct stream_desc
+{
+    snd_pcm_access_t access;
+    int nonblock;                       // opened with SND_PCM_NONBLOCK
+    /* format traits */
+    snd_pcm_format_t format;
+    int format_width;                   // in bit
+    int phys_bps;                       // physical bytes per sample
+    int is_big_endian;
+    int is_unsigned;
+    int is_float;
+    sample_pack_fn pack;                // packer of `format`
+    /* stream */
+    unsigned int channels;
+    unsigned int rate;                  // Hz
+    /* buffer */
+    unsigned int period_time;           // us
+    snd_pcm_uframes_t period_size;      // in frame
+    snd_pcm_uframes_t buffer_size;      // in frame
+    ssize_t frame_bytes;                // bytes of one interleaved frame
+    snd_pcm_uframes_t start_threshold;  // in frame
+};
+
+/* Runtime controls of playback() */
+struct playback_ctl
+{
+    int pause_fd;                       // signalfd, every signal read toggles pause. -1: no pause control
+    int notify_fd;                      // struct playback_event is written here. -1: no notification
+    struct osc_bank *bank;              // voices to play, sized for one period of the stream
+    struct xrun_telemetry *telemetry;   // underrun/suspend/recovery events are recorded here
+};
+
+/* Progress notification, written as a whole to `notify_fd` (atomic on a pipe) */
+enum playback_event_type
+{
+    PLAYBACK_EVENT_PREPARED,            // device prepared, ready to be started
+    PLAYBACK_EVENT_FIRST_FRAME,         // first period has been written to the device
+};
+
+struct playback_event
+{
+    enum playback_event_type type;
+    struct timespec ts;                 // CLOCK_MONOTONIC, comparable across processes
+};
 
 /**************
  * Function
  *************/
-void prepare_device(const char *device_name, snd_pcm_t **handle);
-void playback(snd_pcm_t *handle, unsigned int duration);
+void prepare_device(const char *device_name, snd_pcm_access_t access, int mode, snd_pcm_t **handle, struct stream_desc *desc);
+void notify_event(int notify_fd, enum playback_event_type type);
+void playback(snd_pcm_t *handle, const struct stream_desc *desc, const struct playback_ctl *ctl, unsigned int duration);
 #endif
 
@@ -3,14 +3,144 @@
 This example reads standard from input and writes
 to the default PCM device for 5 seconds of data.
 
+Standard input is read by a separate thread into a lock-free
+ring, so a stall on the input pipe never blocks the writes.
+
+Given a raw S16_LE file instead, it maps the file and plays
+all of it straight from the mapping:
+
+  simple_playback FILE [RATE [CHANNELS]]
+
+Build:
+
+  gcc -o simple_playback simple_playback.c ../common/spsc_ring.c \
+      -I../common -lasound -lpthread
+
 */
 
+/* readahead() */
+#define _GNU_SOURCE
+
 /* Use the newer ALSA API */
 #define ALSA_PCM_NEW_HW_PARAMS_API
 
 #include <alsa/asoundlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "spsc_ring.h"
+
+/* Ring between reader and audio thread, in periods */
+#define RING_PERIODS 128
+
+/* One period read from stdin, short one marks end of input */
+struct chunk {
+  int bytes;
+  char data[];
+};
+
+struct reader {
+  struct spsc_ring ring;
+  sem_t space;          /* posted for every slot given back */
+  atomic_int done;      /* no more chunks coming */
+  int size;             /* bytes of one period */
+};
+
+/*
+ * Fill the ring from stdin. Only this thread ever
+ * blocks on input, the audio thread never waits for it.
+ */
+static void *reader_thread(void *arg) {
+  struct reader *rd = arg;
+  struct chunk *c;
+  int rc;
+
+  do {
+    while ((c = spsc_ring_write_slot(&rd->ring)) == NULL)
+      sem_wait(&rd->space);
+    c->bytes = 0;
+    while (c->bytes < rd->size) {
+      rc = read(0, c->data + c->bytes, rd->size - c->bytes);
+      if (rc < 0 && errno == EINTR)
+        continue;
+      if (rc <= 0)
+        break;
+      c->bytes += rc;
+    }
+    spsc_ring_write_commit(&rd->ring);
+  } while (c->bytes == rd->size);
+
+  atomic_store(&rd->done, 1);
+  return NULL;
+}
+
+/*
+ * Play a mapped file. The kernel reads the file ahead of us
+ * and snd_pcm_writei() copies from the page cache straight into
+ * the ring buffer, no intermediate buffer and no read() calls.
+ */
+static int play_file(snd_pcm_t *handle, const char *path,
+                     int frame_bytes) {
+  int fd;
+  struct stat st;
+  char *file;
+  snd_pcm_uframes_t total, pos;
+  snd_pcm_sframes_t rc;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  if (fstat(fd, &st) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  total = st.st_size / frame_bytes;
+  if (total == 0) {
+    fprintf(stderr, "%s: no complete frame\n", path);
+    close(fd);
+    return -1;
+  }
+  file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (file == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return -1;
+  }
+  /* Read sequentially, start reading now */
+  madvise(file, st.st_size, MADV_SEQUENTIAL);
+  readahead(fd, 0, st.st_size);
+
+  pos = 0;
+  while (pos < total) {
+    /* blocks until all given frames are queued */
+    rc = snd_pcm_writei(handle, file + pos * frame_bytes,
+                        total - pos);
+    if (rc == -EPIPE) {
+      /* EPIPE means underrun */
+      fprintf(stderr, "underrun occurred\n");
+      snd_pcm_prepare(handle);
+    } else if (rc < 0) {
+      fprintf(stderr,
+              "error from writei: %s\n",
+              snd_strerror(rc));
+      break;
+    } else {
+      pos += rc;
+    }
+  }
+
+  munmap(file, st.st_size);
+  close(fd);
+  return pos == total ? 0 : -1;
+}
 
-int main() {
+int main(int argc, char *argv[]) {
   long loops;
   int rc;
   int size;
@@ -20,6 +150,20 @@ int main() {
   int dir;
   snd_pcm_uframes_t frames;
   char *buffer;
+  unsigned int rate = 44100;
+  unsigned int channels = 2;
+  struct reader rd;
+  pthread_t reader_tid;
+  struct chunk *c;
+  int last = 0;
+  unsigned int fill, fill_min = UINT_MAX, fill_max = 0;
+  unsigned long fill_sum = 0, fill_cnt = 0;
+  unsigned long input_underruns = 0;
+
+  if (argc > 2)
+    rate = atoi(argv[2]);
+  if (argc > 3)
+    channels = atoi(argv[3]);
 
   /* Open PCM device for playback. */
   rc = snd_pcm_open(&handle, "default",
@@ -47,11 +191,11 @@ int main() {
   snd_pcm_hw_params_set_format(handle, params,
                               SND_PCM_FORMAT_S16_LE);
 
-  /* Two channels (stereo) */
-  snd_pcm_hw_params_set_channels(handle, params, 2);
+  /* Two channels (stereo) by default */
+  snd_pcm_hw_params_set_channels(handle, params, channels);
 
-  /* 44100 bits/second sampling rate (CD quality) */
-  val = 44100;
+  /* 44100 bits/second sampling rate (CD quality) by default */
+  val = rate;
   snd_pcm_hw_params_set_rate_near(handle, params,
                                   &val, &dir);
 
@@ -69,11 +213,38 @@ int main() {
     exit(1);
   }
 
+  if (argc > 1) {
+    rc = play_file(handle, argv[1], channels * 2);
+    snd_pcm_drain(handle);
+    snd_pcm_close(handle);
+    return rc < 0 ? 1 : 0;
+  }
+
   /* Use a buffer large enough to hold one period */
   snd_pcm_hw_params_get_period_size(params, &frames,
                                     &dir);
-  size = frames * 4; /* 2 bytes/sample, 2 channels */
-  buffer = (char *) malloc(size);
+  size = frames * channels * 2; /* 2 bytes/sample */
+  /* Played when input is late */
+  buffer = (char *) calloc(1, size);
+
+  /* Start reader, let it fill half of the ring */
+  rd.size = size;
+  atomic_init(&rd.done, 0);
+  if (spsc_ring_init(&rd.ring, RING_PERIODS,
+                     sizeof(struct chunk) + size) < 0 ||
+      sem_init(&rd.space, 0, 0) < 0) {
+    fprintf(stderr, "no memory for ring\n");
+    exit(1);
+  }
+  rc = pthread_create(&reader_tid, NULL, reader_thread, &rd);
+  if (rc != 0) {
+    fprintf(stderr, "unable to start reader: %s\n",
+            strerror(rc));
+    exit(1);
+  }
+  while (spsc_ring_fill(&rd.ring) < RING_PERIODS / 2 &&
+         !atomic_load(&rd.done))
+    usleep(1000);
 
   /* We want to loop for 5 seconds */
   snd_pcm_hw_params_get_period_time(params,
@@ -84,15 +255,28 @@ int main() {
 
   while (loops > 0) {
     loops--;
-    rc = read(0, buffer, size);
-    if (rc == 0) {
-      fprintf(stderr, "end of file on input\n");
-      break;
-    } else if (rc != size) {
-      fprintf(stderr,
-              "short read: read %d bytes\n", rc);
+    fill = spsc_ring_fill(&rd.ring);
+    fill_min = fill < fill_min ? fill : fill_min;
+    fill_max = fill > fill_max ? fill : fill_max;
+    fill_sum += fill;
+    fill_cnt++;
+
+    c = spsc_ring_read_slot(&rd.ring);
+    if (c == NULL) {
+      /* Input is late, keep the device fed
+       * instead of waiting for it */
+      input_underruns++;
+      rc = snd_pcm_writei(handle, buffer, frames);
+    } else {
+      last = c->bytes != size;
+      if (last && c->bytes % (channels * 2) != 0)
+        fprintf(stderr,
+                "short read: read %d bytes\n", c->bytes);
+      rc = snd_pcm_writei(handle, c->data,
+                          c->bytes / (channels * 2));
+      spsc_ring_read_release(&rd.ring);
+      sem_post(&rd.space);
     }
-    rc = snd_pcm_writei(handle, buffer, frames);
     if (rc == -EPIPE) {
       /* EPIPE means underrun */
       fprintf(stderr, "underrun occurred\n");
@@ -101,12 +285,28 @@ int main() {
       fprintf(stderr,
               "error from writei: %s\n",
               snd_strerror(rc));
-    }  else if (rc != (int)frames) {
+    }  else if (!last && rc != (int)frames) {
       fprintf(stderr,
               "short write, write %d frames\n", rc);
     }
+    if (last) {
+      fprintf(stderr, "end of file on input\n");
+      break;
+    }
   }
 
+  fprintf(stderr,
+          "ring fill (periods of %d): min %u, avg %.1f, max %u\n",
+          spsc_ring_size(&rd.ring), fill_cnt ? fill_min : 0,
+          fill_cnt ? (double)fill_sum / fill_cnt : 0.0, fill_max);
+  fprintf(stderr, "input underruns: %lu\n", input_underruns);
+
+  /* reader may still be blocked on stdin */
+  pthread_cancel(reader_tid);
+  pthread_join(reader_tid, NULL);
+  sem_destroy(&rd.space);
+  spsc_ring_free(&rd.ring);
+
   snd_pcm_drain(handle);
   snd_pcm_close(handle);
   free(buffer);